@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "accounts.h"
+#include "csv.h"
+#include "metrics.h"
+#include "snapshot.h"
+
+uint64_t account_hash(const char *regno) {
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (; *regno; regno++) {
+        h ^= (unsigned char)*regno;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+size_t account_index_cap(size_t n) {
+    size_t cap = 16;
+    // keep the load factor at or below one half
+    while (cap < n * 2)
+        cap *= 2;
+    return cap;
+}
+
+void account_index_build(uint32_t *index, size_t cap, const struct account *rows, size_t n) {
+    memset(index, 0, cap * sizeof(*index));
+    for (size_t i = 0; i < n; i++) {
+        size_t b = account_hash(rows[i].regno) & (cap - 1);
+        while (index[b]) {
+            // duplicate regno, the first row wins like the old linear scan
+            if (strcmp(rows[index[b] - 1].regno, rows[i].regno) == 0)
+                break;
+            b = (b + 1) & (cap - 1);
+        }
+        if (!index[b])
+            index[b] = (uint32_t)(i + 1);
+    }
+}
+
+struct account *account_index_find(const uint32_t *index, size_t cap, struct account *rows,
+                                   const char *regno) {
+    if (!cap)
+        return NULL;
+    size_t b = account_hash(regno) & (cap - 1);
+    while (index[b]) {
+        struct account *a = &rows[index[b] - 1];
+        if (strcmp(a->regno, regno) == 0)
+            return a;
+        b = (b + 1) & (cap - 1);
+    }
+    return NULL;
+}
+
+static void build_index(struct account_table *t) {
+    t->index_cap = account_index_cap(t->count);
+    t->index = arena_alloc(&t->arena, t->index_cap * sizeof(*t->index));
+    account_index_build(t->index, t->index_cap, t->rows, t->count);
+}
+
+static void copy_record(struct account *a, const struct csv_record *rec) {
+    memcpy(a->regno, rec->regno.ptr, rec->regno.len);
+    a->regno[rec->regno.len] = '\0';
+    memcpy(a->name, rec->name.ptr, rec->name.len);
+    a->name[rec->name.len] = '\0';
+    a->pin = rec->pin;
+    a->balance = rec->balance;
+}
+
+// the first few rejected lines are named, the rest only counted
+#define REJECTS_SHOWN 10
+
+static void reject(struct account_table *t, unsigned long lineno, const struct csv_field *line) {
+    if (t->rejected++ < REJECTS_SHOWN)
+        fprintf(stderr, "Accounts line %lu is not regno,pin,name,balance, kept as it is\n", lineno);
+    string_append(&t->unparsed, line->ptr, line->len);
+    string_append(&t->unparsed, "\n", 1);
+}
+
+static void rejects_done(const struct account_table *t) {
+    if (t->rejected > REJECTS_SHOWN)
+        fprintf(stderr, "%zu more accounts lines are not regno,pin,name,balance\n",
+                t->rejected - REJECTS_SHOWN);
+}
+
+// content with snapshot lines (snapshot.h) in it, maybe next to csv
+// ones. the rows are gathered first, so a line that can't be read
+// leaves t as it was
+static int load_mixed(struct account_table *t, const char *content, size_t len) {
+    struct account *rows = NULL;
+    size_t n = 0, cap = 0;
+    const char *p = content, *end = content + len;
+    // lines before p
+    unsigned long lineno = 0;
+    struct account_table rejects = {0};
+    int rc = 0;
+    while (p < end && rc == 0) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl)
+            nl = end;
+        if ((size_t)(end - p) >= SNAPSHOT_MAGIC_LEN &&
+            memcmp(p, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) == 0) {
+            rc = snapshot_decode(p, nl, &rows, &n, &cap);
+            p = nl < end ? nl + 1 : end;
+            lineno++;
+            continue;
+        }
+        // csv up to the next snapshot line
+        const char *next = strstr(p, "\n" SNAPSHOT_MAGIC);
+        const char *run_end = next ? next + 1 : end;
+        struct csv_reader r;
+        struct csv_record rec;
+        csv_reader_init(&r, p, run_end - p);
+        int got;
+        while ((got = csv_read(&r, &rec)) != 0) {
+            if (got < 0 || rec.regno.len >= REGNO_LEN || rec.name.len >= NAME_LEN) {
+                reject(&rejects, lineno + r.lineno, &rec.line);
+                continue;
+            }
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                rows = realloc(rows, cap * sizeof(*rows));
+                if (!rows) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
+            }
+            copy_record(&rows[n++], &rec);
+        }
+        p = run_end;
+        lineno += r.lineno;
+    }
+    if (rc == 0) {
+        account_table_set_rows(t, rows, n);
+        t->rejected = rejects.rejected;
+        if (rejects.unparsed.len)
+            string_append(&t->unparsed, rejects.unparsed.ptr, rejects.unparsed.len);
+        rejects_done(t);
+    } else {
+        fprintf(stderr, "Invalid account snapshot\n");
+    }
+    free(rejects.unparsed.ptr);
+    free(rows);
+    return rc;
+}
+
+int account_table_load(struct account_table *t, const char *csv) {
+    uint64_t t0 = metrics_now_us();
+    size_t len = strlen(csv);
+    if (strstr(csv, SNAPSHOT_MAGIC)) {
+        int rc = load_mixed(t, csv, len);
+        metrics_observe(METRIC_CSV_LOAD, metrics_now_us() - t0);
+        return rc;
+    }
+    arena_reset(&t->arena);
+    t->count = 0;
+    t->rejected = 0;
+    t->unparsed.len = 0;
+
+    // one slot per line, so the rows are a single allocation
+    size_t lines = 1;
+    for (const char *p = csv, *end = csv + len; (p = memchr(p, '\n', end - p)); p++)
+        lines++;
+    t->rows = arena_alloc(&t->arena, lines * sizeof(*t->rows));
+
+    struct csv_reader r;
+    struct csv_record rec;
+    int got;
+    csv_reader_init(&r, csv, len);
+    while ((got = csv_read(&r, &rec)) != 0) {
+        if (got < 0 || rec.regno.len >= REGNO_LEN || rec.name.len >= NAME_LEN) {
+            reject(t, r.lineno, &rec.line);
+            continue;
+        }
+        copy_record(&t->rows[t->count++], &rec);
+    }
+    rejects_done(t);
+
+    build_index(t);
+    metrics_observe(METRIC_CSV_LOAD, metrics_now_us() - t0);
+    return 0;
+}
+
+int account_table_set_rows(struct account_table *t, const struct account *rows, size_t n) {
+    arena_reset(&t->arena);
+    t->rows = arena_alloc(&t->arena, (n ? n : 1) * sizeof(*t->rows));
+    if (n)
+        memcpy(t->rows, rows, n * sizeof(*rows));
+    t->count = n;
+    t->rejected = 0;
+    t->unparsed.len = 0;
+    build_index(t);
+    return 0;
+}
+
+void account_table_free(struct account_table *t) {
+    arena_free(&t->arena);
+    free(t->unparsed.ptr);
+    memset(t, 0, sizeof(*t));
+}
+
+struct account *account_table_find(const struct account_table *t, const char *regno) {
+    return account_index_find(t->index, t->index_cap, t->rows, regno);
+}
+
+void account_table_append_csv(const struct account_table *t, struct string *out) {
+    uint64_t t0 = metrics_now_us();
+    // regno, pin, name, balance, three commas and a newline
+    string_reserve(out, t->count * 32);
+    for (size_t i = 0; i < t->count; i++) {
+        const struct account *a = &t->rows[i];
+        string_append_str(out, a->regno);
+        string_append(out, ",", 1);
+        string_append_int(out, a->pin);
+        string_append(out, ",", 1);
+        string_append_str(out, a->name);
+        string_append(out, ",", 1);
+        string_append_int(out, a->balance);
+        string_append(out, "\n", 1);
+    }
+    if (t->unparsed.len)
+        string_append(out, t->unparsed.ptr, t->unparsed.len);
+    metrics_observe(METRIC_CSV_BUILD, metrics_now_us() - t0);
+}
+
+void account_table_append_compact(const struct account_table *t, struct string *out) {
+    uint64_t t0 = metrics_now_us();
+    snapshot_append(t->rows, t->count, out);
+    // csv lines may follow a snapshot line, these load as unparsed again
+    if (t->unparsed.len)
+        string_append(out, t->unparsed.ptr, t->unparsed.len);
+    metrics_observe(METRIC_CSV_BUILD, metrics_now_us() - t0);
+}
@@ -0,0 +1,70 @@
+#ifndef ACCOUNTS_H
+#define ACCOUNTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "strbuf.h"
+
+#define REGNO_LEN 20
+#define NAME_LEN 50
+
+struct account {
+    char regno[REGNO_LEN];
+    int pin;
+    char name[NAME_LEN];
+    int balance;
+};
+
+// every row of nfc_data.csv in file order, plus an open addressing
+// index on regno. a row keeps its slot for the lifetime of the table,
+// so struct account pointers stay valid until the next load
+struct account_table {
+    struct account *rows;
+    size_t count;
+    // row number + 1 per bucket, 0 means empty. size is a power of two
+    uint32_t *index;
+    size_t index_cap;
+    // rows and index live here and are dropped in bulk on reload
+    struct arena arena;
+    // lines of the last load that weren't rows: malformed, or with a
+    // regno or name too long to hold. each is reported on stderr and
+    // kept as it was in unparsed, one line each, so writing the table
+    // back doesn't delete them from the gist
+    size_t rejected;
+    struct string unparsed;
+};
+
+// replaces the contents of t with the rows of csv, which may also hold
+// compact snapshot lines (snapshot.h). returns 0 on success; on a
+// snapshot line that can't be read t is left as it was and -1 returned.
+// csv lines that aren't rows don't fail the load, they are counted in
+// t->rejected
+int account_table_load(struct account_table *t, const char *csv);
+// the same from rows that are already parsed, rows[0..n) are copied
+int account_table_set_rows(struct account_table *t, const struct account *rows, size_t n);
+void account_table_free(struct account_table *t);
+
+// first row with this regno, NULL if there is none
+struct account *account_table_find(const struct account_table *t, const char *regno);
+
+// FNV-1a of regno. the index, the write queue and the gist shards all
+// hash with it
+uint64_t account_hash(const char *regno);
+
+// the index on its own, for rows kept somewhere else: row number + 1
+// per bucket, 0 means empty, over cap buckets where cap comes from
+// account_index_cap(n). the first row of a duplicate regno wins
+size_t account_index_cap(size_t n);
+void account_index_build(uint32_t *index, size_t cap, const struct account *rows, size_t n);
+struct account *account_index_find(const uint32_t *index, size_t cap, struct account *rows,
+                                   const char *regno);
+
+// appends every row back out in nfc_data.csv format, followed by the
+// unparsed lines
+void account_table_append_csv(const struct account_table *t, struct string *out);
+// the same with the rows as one compact snapshot line, see snapshot.h
+void account_table_append_compact(const struct account_table *t, struct string *out);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_CHUNK 4096
+
+static struct arena_chunk *new_chunk(size_t cap) {
+    struct arena_chunk *c = malloc(sizeof(*c) + cap);
+    if (c == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    c->next = NULL;
+    c->cap = cap;
+    c->used = 0;
+    return c;
+}
+
+void arena_init(struct arena *a) {
+    a->head = NULL;
+    a->total = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_chunk *c = a->head;
+    if (c == NULL || c->cap - c->used < n) {
+        size_t cap = c ? c->cap * 2 : ARENA_MIN_CHUNK;
+        if (cap < n)
+            cap = n;
+        c = new_chunk(cap);
+        c->next = a->head;
+        a->head = c;
+    }
+    void *p = c->data + c->used;
+    c->used += n;
+    a->total += n;
+    return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t n) {
+    char *p = arena_alloc(a, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+void arena_reset(struct arena *a) {
+    struct arena_chunk *c = a->head;
+    if (c && c->next) {
+        size_t cap = a->total > c->cap ? a->total : c->cap;
+        arena_free(a);
+        c = new_chunk(cap);
+        a->head = c;
+    }
+    if (c)
+        c->used = 0;
+    a->total = 0;
+}
+
+void arena_free(struct arena *a) {
+    struct arena_chunk *c = a->head;
+    while (c) {
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->head = NULL;
+    a->total = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// bump allocator for data that lives and dies together (one response,
+// one snapshot's records). chunks double in size, nothing is freed
+// individually, and a reset keeps the memory for the next round
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t cap;
+    size_t used;
+    // malloc's alignment carries through to data, and every allocation
+    // is a multiple of 16 bytes
+    _Alignas(16) char data[];
+};
+
+struct arena {
+    struct arena_chunk *head;
+    size_t total;
+};
+
+void arena_init(struct arena *a);
+// 16 byte aligned, never NULL (exits like the rest of the code on OOM)
+void *arena_alloc(struct arena *a, size_t n);
+char *arena_strndup(struct arena *a, const char *s, size_t n);
+// forget every allocation. the chunks are coalesced into a single block
+// big enough for everything that was allocated, so a workload of the
+// same size afterwards costs no malloc at all
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+#endif
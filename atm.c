@@ -2,185 +2,222 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <curl/curl.h>
-#include <json-c/json.h>
 #include <ncurses.h>
+#include <panel.h>
 #include <locale.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#include "accounts.h"
+#include "batch.h"
+#include "client.h"
+#include "metrics.h"
+#include "proto.h"
+#include "refresher.h"
+#include "store.h"
+#include "tty_stats.h"
+
+// where the accounts live (ATM_STORE) and the latest rows read from it.
+// the refresher (refresher.h) keeps a snapshot of them warm, at least
+// every ATM_REFRESH_MS milliseconds, and the terminal reads from that
+static struct store store;
+static struct account_table accounts;
+
+#define REFRESH_MS_DEFAULT 5000
+
+// who is logged in, taken from the snapshot that authenticated them.
+// the menu works on this copy, so entering it costs no round trip
+struct session {
+    struct account acct;
+    // store generation acct was read at
+    unsigned long generation;
+    // set once the session changed the row. the snapshot only catches up
+    // with that after the change has been written, until then acct is
+    // the better copy
+    int dirty;
+};
 
-#define GIST_ID ""
-#define GITHUB_TOKEN ""
-#define FILE_NAME "nfc_data.csv"
-#define API_URL "https://api.github.com/gists/" GIST_ID
+// set when ATM_SOCKET names an atmd to talk to. the daemon then owns
+// the data and this process is only the terminal
+static int remote;
+
+// the session's changes go to atmd in client mode and to the store
+// otherwise. returns a proto_status, -1 if atmd is gone
+static int change_balance(struct session *s, int delta) {
+    struct account *me = &s->acct;
+    if (remote)
+        return client_add_balance(me->regno, delta, &me->balance);
+    s->dirty = 1;
+    if (store.ops->add_balance(&store, me->regno, delta, me->balance + delta) != 0)
+        return PROTO_INSUFFICIENT;
+    me->balance += delta;
+    return store.ops->commit(&store) == 0 ? PROTO_OK : PROTO_FAILED;
+}
 
+static int change_name(struct session *s, const char *name) {
+    struct account *me = &s->acct;
+    snprintf(me->name, sizeof(me->name), "%s", name);
+    if (remote)
+        return client_set_name(me->regno, me->name);
+    s->dirty = 1;
+    store.ops->set_name(&store, me->regno, me->name);
+    return store.ops->commit(&store) == 0 ? PROTO_OK : PROTO_FAILED;
+}
 
-struct string {
-    char *ptr;
-    size_t len;
-};
+static int change_pin(struct session *s, int pin) {
+    struct account *me = &s->acct;
+    me->pin = pin;
+    if (remote)
+        return client_set_pin(me->regno, me->pin);
+    s->dirty = 1;
+    store.ops->set_pin(&store, me->regno, me->pin);
+    return store.ops->commit(&store) == 0 ? PROTO_OK : PROTO_FAILED;
+}
 
-void init_string(struct string *s) {
-    s->len = 0;
-    s->ptr = malloc(1);
-    if (s->ptr == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
-    s->ptr[0] = '\0';
+// how often the spinner moves while we wait on the network
+#define SPIN_MS 100
+#define IDLE_POLL_MS 250
+
+static const char spinner[] = "|/-\\";
+
+static void draw_spinner(WINDOW *win, int y, int x, const char *label, int frame) {
+    mvwprintw(win, y, x, "%s %c  ESC to cancel", label, spinner[frame % 4]);
+    wrefresh(win);
 }
 
-size_t writefunc(void *ptr, size_t size, size_t nmemb, struct string *s) {
-    size_t new_len = s->len + size * nmemb;
-    s->ptr = realloc(s->ptr, new_len + 1);
-    if (s->ptr == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
-    memcpy(s->ptr + s->len, ptr, size * nmemb);
-    s->ptr[new_len] = '\0';
-    s->len = new_len;
-    return size * nmemb;
+static void clear_spinner(WINDOW *win, int y, int x, const char *label) {
+    mvwprintw(win, y, x, "%*s", (int)strlen(label) + 17, "");
+    wrefresh(win);
 }
 
-char *fetch_gist_content() {
-    CURL *curl = curl_easy_init();
-    struct string response;
-    init_string(&response);
-
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Authorization: token " GITHUB_TOKEN);
-        headers = curl_slist_append(headers, "User-Agent: ATM-Simulator");
-
-        curl_easy_setopt(curl, CURLOPT_URL, API_URL);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        CURLcode res = curl_easy_perform(curl);
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
-
-        if (res != CURLE_OK) {
-            fprintf(stderr, "CURL request failed: %s\n", curl_easy_strerror(res));
-            free(response.ptr);
-            return NULL;
-        }
+// eats whatever was typed meanwhile, 1 if it included ESC
+static int esc_pressed(WINDOW *win) {
+    int ch, esc = 0;
+    nodelay(win, TRUE);
+    while ((ch = wgetch(win)) != ERR) {
+        if (ch == 27)
+            esc = 1;
     }
+    nodelay(win, FALSE);
+    return esc;
+}
 
-    struct json_object *parsed_json = json_tokener_parse(response.ptr);
-    if (parsed_json == NULL) {
-        fprintf(stderr, "JSON parsing failed: %s\n", response.ptr);
-        free(response.ptr);
-        return NULL;
+// the refresh the login form asks for as soon as the register number
+// is in, so the row is usually current by the time the PIN has been
+// typed. only the shard holding that regno is fetched
+static unsigned long login_ticket;
+
+// waits for the refresh behind ticket without blocking the terminal: a
+// spinner at y,x of win shows it is still going and ESC stops waiting
+// (the refresh itself carries on). returns 0 once it has succeeded, -1
+// on failure or cancel
+static int wait_refresh(WINDOW *win, int y, int x, unsigned long ticket) {
+    int frame = 0, rc;
+    while ((rc = refresher_wait(ticket, SPIN_MS)) == 0) {
+        if (esc_pressed(win))
+            break;
+        draw_spinner(win, y, x, "Fetching data", frame++);
     }
+    if (frame)
+        clear_spinner(win, y, x, "Fetching data");
+    return rc == 1 ? 0 : -1;
+}
 
-    struct json_object *files, *file_content, *content;
-    if (!json_object_object_get_ex(parsed_json, "files", &files) ||
-        !json_object_object_get_ex(files, FILE_NAME, &file_content) ||
-        !json_object_object_get_ex(file_content, "content", &content)) {
-        fprintf(stderr, "Invalid JSON structure\n");
-        json_object_put(parsed_json);
-        free(response.ptr);
-        return NULL;
+// wgetch for wherever the terminal sits waiting for a key, looking up
+// every IDLE_POLL_MS for a metrics export
+static int idle_getch(WINDOW *win) {
+    int ch;
+    nodelay(win, TRUE);
+    while ((ch = wgetch(win)) == ERR) {
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        poll(&pfd, 1, IDLE_POLL_MS);
+        metrics_poll();
     }
-
-    char *data = strdup(json_object_get_string(content));
-    json_object_put(parsed_json);
-    free(response.ptr);
-    return data;
+    nodelay(win, FALSE);
+    return ch;
 }
 
-static void escape_string(const char *src, char *dst, size_t dst_size) {
-    size_t pos = 0;
-    for (; *src && pos + 2 < dst_size; src++) {
-        if (*src == '\\' || *src == '"') {
-            dst[pos++] = '\\';
-            dst[pos++] = *src;
-        } else if (*src == '\n') {
-            if (pos + 2 >= dst_size) break;
-            dst[pos++] = '\\';
-            dst[pos++] = 'n';
-        } else {
-            dst[pos++] = *src;
+// reads a login field at the cursor. the PIN is digits only and echoed
+// as '*'
+static void login_read(WINDOW *win, char *buf, int size, int secret) {
+    int idx = 0;
+    int x0 = getcurx(win);
+    while (1) {
+        int ch = idle_getch(win);
+        if (ch == '\n') {
+            break;
+        } else if (ch == KEY_BACKSPACE || ch == 127) {
+            if (idx > 0) {
+                idx--;
+                int y, x;
+                getyx(win, y, x);
+                if (x > x0) {
+                    mvwaddch(win, y, x - 1, ' ');
+                    wmove(win, y, x - 1);
+                }
+            }
+        } else if (idx < size - 1 && (secret ? isdigit(ch) : isprint(ch))) {
+            buf[idx++] = ch;
+            waddch(win, secret ? '*' : ch);
         }
+        wrefresh(win);
     }
-    dst[pos] = '\0';
+    buf[idx] = '\0';
 }
 
-// FUNCTION TO IGNORE JSON DUMP
-static size_t discard_response(void *ptr, size_t size, size_t nmemb, void *userdata) {
-    (void)ptr;
-    (void)userdata;
-    return size * nmemb; 
-}
-
-void update_gist_content(const char *updated_content) {
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        fprintf(stderr, "Failed to initialize CURL\n");
-        return;
+// checks the credentials and fills in s. returns 1 if they are good, 0
+// if not and -1 if the accounts couldn't be loaded
+static int authenticate(WINDOW *win, const char *regno, int pin, struct session *s) {
+    memset(s, 0, sizeof(*s));
+    if (remote) {
+        int rc = client_login(regno, pin, &s->acct);
+        return rc < 0 ? -1 : rc == PROTO_OK;
     }
 
-    char escaped_content[8192];
-    escape_string(updated_content, escaped_content, sizeof(escaped_content));
-
-    char json_payload[16384];
-    snprintf(json_payload, sizeof(json_payload),
-             "{\"files\": {\"%s\": {\"content\": \"%s\"}}}",
-             FILE_NAME, escaped_content);
-
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Authorization: token " GITHUB_TOKEN);
-    headers = curl_slist_append(headers, "User-Agent: ATM-Simulator");
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-
-    curl_easy_setopt(curl, CURLOPT_URL, API_URL);
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_payload);
-
-    // ignore json response
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_response);
-
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "Failed to update gist: %s\n", curl_easy_strerror(res));
+    // normally straight from memory
+    int found = refresher_lookup(regno, &s->acct, &s->generation);
+    if (!found || s->acct.pin != pin) {
+        // the snapshot may predate a new account or PIN (or not be there
+        // yet at all): wait for the login form's refresh before turning
+        // the user away
+        if (wait_refresh(win, 7, 2, login_ticket) != 0)
+            return -1;
+        found = refresher_lookup(regno, &s->acct, &s->generation);
     }
-
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
+    return found && s->acct.pin == pin;
 }
 
-// rebuild csv
-void reload_data_and_update(const char *regno, int pin, const char *user_name, int new_balance)
-{
-    char *temp_data = fetch_gist_content();
-    if (!temp_data) {
-        fprintf(stderr, "Failed to retrieve data\n");
+// picks up what other terminals did to the row since the session read
+// it, unless the session has changed it itself. memory only
+static void session_sync(struct session *s) {
+    struct account a;
+    unsigned long generation;
+    if (remote || s->dirty)
         return;
+    if (refresher_lookup(s->acct.regno, &a, &generation) && generation != s->generation) {
+        s->acct = a;
+        s->generation = generation;
     }
+}
 
-    char final_data[8192] = "";
-    char *line = strtok(temp_data, "\n");
-    while (line) {
-        char file_regno[20], file_name[50];
-        int file_pin, file_balance;
-        sscanf(line, "%[^,],%d,%[^,],%d", file_regno, &file_pin, file_name, &file_balance);
-
-        if (strcmp(file_regno, regno) == 0) {
-            snprintf(final_data + strlen(final_data),
-                     sizeof(final_data) - strlen(final_data),
-                     "%s,%d,%s,%d\n", regno, pin, user_name, new_balance);
-        }
-        else {
-            strncat(final_data, line, sizeof(final_data) - strlen(final_data) - 1);
-            strncat(final_data, "\n", sizeof(final_data) - strlen(final_data) - 1);
-        }
-        line = strtok(NULL, "\n");
+// waits for the queued changes to be written, same spinner. on ESC we
+// stop waiting, the queue gets one more go on the way out
+static void save_changes(WINDOW *win, int y, int x) {
+    struct store_ticket t;
+    if (remote) {
+        if (client_flush_start() != 0)
+            return;
+    } else {
+        t = store.ops->flush_start(&store);
+    }
+    int frame = 0;
+    while ((remote ? client_flush_wait(SPIN_MS) : store.ops->flush_wait(&store, &t, SPIN_MS)) == 0) {
+        if (esc_pressed(win))
+            break;
+        draw_spinner(win, y, x, "Saving", frame++);
     }
-
-    update_gist_content(final_data);
-    free(temp_data);
 }
 
 // static int read_line_with_esc(char *buffer, int buffer_size) {
@@ -246,321 +283,356 @@ static int read_line_with_esc_in_window(WINDOW *win, char *buffer, int buffer_si
     }
 }
 
-void process_transaction(char *regno, int pin) {
-    char *data = fetch_gist_content();
-    if (!data) {
-        fprintf(stderr, "Failed to retrieve data\n");
-        return;
+// the menu screen. the banner goes on stdscr and is drawn once per
+// session; the menu and the page of whichever entry was picked are two
+// windows in the same spot, stacked as panels, so switching between
+// them repaints the box and nothing else. everything goes out through
+// update_panels + doupdate, one write per change
+#define MENU_H 15
+#define MENU_W 60
+#define MENU_ITEMS 5
+
+static const char *const menu_items[MENU_ITEMS] = {
+    "Check Balance", "Withdraw", "Deposit", "Exit", "Account Settings",
+};
+
+static struct {
+    WINDOW *menu;
+    WINDOW *page;
+    PANEL *menu_panel;
+    PANEL *page_panel;
+} ui;
+
+static void ui_update(void) {
+    update_panels();
+    doupdate();
+}
+
+static void draw_menu_item(int i, int selected) {
+    if (selected) wattron(ui.menu, A_REVERSE);
+    mvwprintw(ui.menu, 6 + i, 4, "%d. %s", i + 1, menu_items[i]);
+    wattroff(ui.menu, A_REVERSE);
+}
+
+static void ui_open(const struct account *me) {
+    clear();
+    const char *ascii_art[] = {
+        "██████╗  █████╗ ███╗   ██╗██╗  ██╗         ██████╗ ███████╗         █████╗ ███╗   ███╗██████╗ ██╗████████╗ █████╗ ",
+        "██╔══██╗██╔══██╗████╗  ██║██║ ██╔╝        ██╔═══██╗██╔════╝        ██╔══██╗████╗ ████║██╔══██╗██║╚══██╔══╝██╔══██╗",
+        "██████╔╝███████║██╔██╗ ██║█████╔╝         ██║   ██║█████╗          ███████║██╔████╔██║██████╔╝██║   ██║   ███████║",
+        "██╔══██╗██╔══██║██║╚██╗██║██╔═██╗         ██║   ██║██╔══╝          ██╔══██║██║╚██╔╝██║██╔══██╗██║   ██║   ██╔══██║",
+        "██████╔╝██║  ██║██║ ╚████║██║  ██╗        ╚██████╔╝██║             ██║  ██║██║ ╚═╝ ██║██║  ██║██║   ██║   ██║  ██║",
+        "╚═════╝ ╚═╝  ╚═╝╚═╝  ╚═══╝╚═╝  ╚═╝         ╚═════╝ ╚═╝             ╚═╝  ╚═╝╚═╝     ╚═╝╚═╝  ╚═╝╚═╝   ╚═╝   ╚═╝  ╚═╝"
+    };
+    int ascii_lines = sizeof(ascii_art) / sizeof(ascii_art[0]);
+    // APPROXIMATE FIX THIS SHIT!!
+    int ascii_width = 108;
+    // topline
+    int ascii_start_y = (LINES - ascii_lines) / 4; // shift up
+    int ascii_start_x = (COLS - ascii_width) / 2;
+
+    for (int i = 0; i < ascii_lines; i++) {
+        mvprintw(ascii_start_y + i, ascii_start_x, "%s", ascii_art[i]);
     }
 
-    int found = 0, balance = 0;
-    char user_name[50];
-    char new_data[8192] = "";
-    char *line = strtok(data, "\n");
-
-    while (line) {
-        char file_regno[20], file_name[50];
-        int  file_pin, file_balance;
-        sscanf(line, "%[^,],%d,%[^,],%d", file_regno, &file_pin, file_name, &file_balance);
-        if (strcmp(file_regno, regno) == 0) {
-            found = 1;
-            if (file_pin != pin) {
-                printf("Incorrect PIN.\n");
-                free(data);
-                return;
-            }
-            strcpy(user_name, file_name);
-            balance = file_balance;
+    // box
+    int starty = ascii_start_y + ascii_lines + 2; // lines below the art
+    int startx = (COLS - MENU_W) / 2;
+    ui.menu = newwin(MENU_H, MENU_W, starty, startx);
+    keypad(ui.menu, TRUE);
+    box(ui.menu, 0, 0);
+    mvwprintw(ui.menu, 0, MENU_W - 12, "ESC to Exit");
+    mvwprintw(ui.menu, 2, 2, "Welcome to Bank of Amrita, %s!", me->name);
+    mvwprintw(ui.menu, 4, 2, "Use ARROW KEYS to navigate, ENTER to select:");
+    for (int i = 0; i < MENU_ITEMS; i++)
+        draw_menu_item(i, i == 0);
+
+    ui.page = newwin(MENU_H, MENU_W, starty, startx);
+    keypad(ui.page, TRUE);
+    ui.menu_panel = new_panel(ui.menu);
+    ui.page_panel = new_panel(ui.page);
+    hide_panel(ui.page_panel);
+    ui_update();
+}
+
+static void ui_close(void) {
+    del_panel(ui.page_panel);
+    del_panel(ui.menu_panel);
+    delwin(ui.page);
+    delwin(ui.menu);
+    memset(&ui, 0, sizeof(ui));
+    clear();
+}
+
+// an empty page over the menu, ready to be drawn on
+static WINDOW *page_open(void) {
+    werase(ui.page);
+    box(ui.page, 0, 0);
+    mvwprintw(ui.page, 0, MENU_W - 15, "ESC to Go Back");
+    show_panel(ui.page_panel);
+    ui_update();
+    return ui.page;
+}
+
+static void page_close(void) {
+    hide_panel(ui.page_panel);
+    ui_update();
+}
+
+// shows what was drawn on the page until ESC
+static void page_wait_esc(WINDOW *page) {
+    ui_update();
+    while (idle_getch(page) != 27) { }
+}
+
+// reads an amount on the page. returns it, 0 after ESC or -1 after
+// telling the user it's no good
+static int page_read_amount(WINDOW *page, const char *prompt) {
+    mvwprintw(page, 2, 2, "%s", prompt);
+    wmove(page, 3, 2);
+    ui_update();
+    echo();
+    char amt_str[12];
+    noecho();
+    if (read_line_with_esc_in_window(page, amt_str, sizeof(amt_str)))
+        return 0;
+    for (int i = 0; amt_str[i] != '\0'; i++) {
+        if (!isdigit((unsigned char)amt_str[i])) {
+            mvwprintw(page, 5, 2, "Invalid amount. Only numbers allowed!");
+            return -1;
         }
-        char temp[100];
-        snprintf(temp, sizeof(temp), "%s,%d,%s,%d\n", file_regno, file_pin, file_name, file_balance);
-        strcat(new_data, temp);
-        line = strtok(NULL, "\n");
     }
-
-    free(data);
-    if (!found) {
-        printf("User not found!\n");
-        return;
+    int amount = atoi(amt_str);
+    if (amount <= 0) {
+        mvwprintw(page, 5, 2, "Invalid amount. Must be positive!");
+        return -1;
     }
+    return amount;
+}
 
-    // main menu LOOP
+static void account_settings(struct session *s) {
+    struct account *me = &s->acct;
+    WINDOW *page = page_open();
+    int settings_idx = 0;
+    int settings_opts_count = 2;
+    const char *settings_opts[] = {"Change Name", "Change PIN"};
     while (1) {
-        clear();
-        const char *ascii_art[] = {
-            "██████╗  █████╗ ███╗   ██╗██╗  ██╗         ██████╗ ███████╗         █████╗ ███╗   ███╗██████╗ ██╗████████╗ █████╗ ",
-            "██╔══██╗██╔══██╗████╗  ██║██║ ██╔╝        ██╔═══██╗██╔════╝        ██╔══██╗████╗ ████║██╔══██╗██║╚══██╔══╝██╔══██╗",
-            "██████╔╝███████║██╔██╗ ██║█████╔╝         ██║   ██║█████╗          ███████║██╔████╔██║██████╔╝██║   ██║   ███████║",
-            "██╔══██╗██╔══██║██║╚██╗██║██╔═██╗         ██║   ██║██╔══╝          ██╔══██║██║╚██╔╝██║██╔══██╗██║   ██║   ██╔══██║",
-            "██████╔╝██║  ██║██║ ╚████║██║  ██╗        ╚██████╔╝██║             ██║  ██║██║ ╚═╝ ██║██║  ██║██║   ██║   ██║  ██║",
-            "╚═════╝ ╚═╝  ╚═╝╚═╝  ╚═══╝╚═╝  ╚═╝         ╚═════╝ ╚═╝             ╚═╝  ╚═╝╚═╝     ╚═╝╚═╝  ╚═╝╚═╝   ╚═╝   ╚═╝  ╚═╝"
-        };
-        int ascii_lines = sizeof(ascii_art) / sizeof(ascii_art[0]);
-        // APPROXIMATE FIX THIS SHIT!!
-        int ascii_width = 108; 
-        // topline
-        int ascii_start_y = (LINES - ascii_lines) / 4; // shift up
-        int ascii_start_x = (COLS - ascii_width) / 2;
-
-        for (int i = 0; i < ascii_lines; i++) {
-            mvprintw(ascii_start_y + i, ascii_start_x, "%s", ascii_art[i]);
+        // Draw settings menu
+        for (int i = 0; i < settings_opts_count; i++) {
+            if (i == settings_idx) wattron(page, A_REVERSE);
+            mvwprintw(page, 2 + i, 2, "%d. %s", i + 1, settings_opts[i]);
+            wattroff(page, A_REVERSE);
         }
-        // refresh
-        refresh();
-
-        // box
-        int menu_h = 15, menu_w = 60;
-        int starty = ascii_start_y + ascii_lines + 2; // lines below the art
-        int startx = (COLS - menu_w) / 2;
-        WINDOW *menuwin = newwin(menu_h, menu_w, starty, startx);
-        keypad(menuwin, TRUE);
-        box(menuwin, 0, 0);
-
-        mvwprintw(menuwin, 0, menu_w - 12, "ESC to Exit");
-        mvwprintw(menuwin, 2, 2, "Welcome to Bank of Amrita, %s!", user_name);
-        mvwprintw(menuwin, 4, 2, "Use ARROW KEYS to navigate, ENTER to select:");
-        mvwprintw(menuwin, 6, 4, "1. Check Balance");
-        mvwprintw(menuwin, 7, 4, "2. Withdraw");
-        mvwprintw(menuwin, 8, 4, "3. Deposit");
-        mvwprintw(menuwin, 9, 4, "4. Exit");
-        mvwprintw(menuwin, 10, 4, "5. Account Settings");
-        wrefresh(menuwin);
-
-        int choice_idx = 0;
-        int ch;
-        while (1) {
-            for (int i = 0; i < 5; i++) {
-                if (i == choice_idx) wattron(menuwin, A_REVERSE);
-                mvwprintw(menuwin, 6 + i, 4, "%d. ", i + 1);
-                switch (i) {
-                    case 0: wprintw(menuwin, "Check Balance");    break;
-                    case 1: wprintw(menuwin, "Withdraw");         break;
-                    case 2: wprintw(menuwin, "Deposit");          break;
-                    case 3: wprintw(menuwin, "Exit");             break;
-                    case 4: wprintw(menuwin, "Account Settings"); break;
-                }
-                wattroff(menuwin, A_REVERSE);
-            }
-            wrefresh(menuwin);
-
-            ch = wgetch(menuwin);
-            if (ch == KEY_UP) {
-                choice_idx = (choice_idx == 0) ? 4 : choice_idx - 1;
-            } else if (ch == KEY_DOWN) {
-                choice_idx = (choice_idx == 4) ? 0 : choice_idx + 1;
-            } else if (ch == 27) {
-                // esc on main menu
-                delwin(menuwin);
-                clear();
-                return;
-            } else if (ch == '\n') {
+        ui_update();
+
+        int c_input = idle_getch(page);
+        if (c_input == KEY_UP) {
+            settings_idx = (settings_idx == 0) ? settings_opts_count - 1 : settings_idx - 1;
+        } else if (c_input == KEY_DOWN) {
+            settings_idx = (settings_idx == settings_opts_count - 1) ? 0 : settings_idx + 1;
+        } else if (c_input == 27) { // ESC
+            return;
+        } else if (c_input == '\n') {
+            break;
+        }
+    }
+
+    // the form replaces the list on the same page
+    page = page_open();
+    if (settings_idx == 0) { // Change Name
+        mvwprintw(page, 2, 2, "Change Name");
+        mvwprintw(page, 3, 2, "Enter your new name:");
+        wmove(page, 4, 2);
+        ui_update();
+        echo();
+        char new_name[50];
+        noecho();
+        if (read_line_with_esc_in_window(page, new_name, sizeof(new_name)))
+            return;
+        if (change_name(s, new_name) == PROTO_OK)
+            mvwprintw(page, 6, 2, "Name updated to: %s", me->name);
+        else
+            mvwprintw(page, 6, 2, "Name change failed.");
+        // the greeting on the menu carries the name
+        mvwprintw(ui.menu, 2, 2, "Welcome to Bank of Amrita, %s!", me->name);
+        wclrtoeol(ui.menu);
+        box(ui.menu, 0, 0);
+        mvwprintw(ui.menu, 0, MENU_W - 12, "ESC to Exit");
+    } else { // Change PIN
+        mvwprintw(page, 2, 2, "Change PIN");
+        mvwprintw(page, 3, 2, "Enter your new PIN (0000-9999):");
+        wmove(page, 4, 2);
+        ui_update();
+        echo();
+        char new_pin_str[10];
+        noecho();
+        if (read_line_with_esc_in_window(page, new_pin_str, sizeof(new_pin_str)))
+            return;
+        bool valid_pin = true;
+        int len = strlen(new_pin_str);
+        for (int i = 0; i < len; i++) {
+            if (!isdigit((unsigned char)new_pin_str[i])) {
+                valid_pin = false;
                 break;
             }
         }
-        delwin(menuwin);
-        refresh();
-
-        // clear screen
-        // create box
-        int sub_h = 15, sub_w = 60; 
-        // int sy = (LINES - sub_h) / 2;
-        // int sx = (COLS - sub_w) / 2;
-        WINDOW *subwin = newwin(menu_h, menu_w, starty, startx);
-        keypad(subwin, TRUE);
-        box(subwin, 0, 0);
-        mvwprintw(subwin, 0, sub_w - 15, "ESC to Go Back");
-        wrefresh(subwin);
+        if (!valid_pin || len == 0 || len > 4) {
+            mvwprintw(page, 6, 2, "Invalid PIN. Must be 1-4 digits.");
+        } else {
+            int new_pin_val = atoi(new_pin_str);
+            if (new_pin_val >= 0 && new_pin_val <= 9999) {
+                if (change_pin(s, new_pin_val) == PROTO_OK)
+                    mvwprintw(page, 6, 2, "PIN updated to: %d", me->pin);
+                else
+                    mvwprintw(page, 6, 2, "PIN change failed.");
+            } else {
+                mvwprintw(page, 6, 2, "Invalid PIN. Must be 0000-9999.");
+            }
+        }
+    }
+    page_wait_esc(page);
+}
 
+void process_transaction(struct session *s) {
+    struct account *me = &s->acct;
+    ui_open(me);
+
+    // main menu LOOP
+    int choice_idx = 0;
+    while (1) {
+        int ch = idle_getch(ui.menu);
+        if (ch == KEY_UP || ch == KEY_DOWN) {
+            // only the two rows whose highlight moved are redrawn
+            draw_menu_item(choice_idx, 0);
+            if (ch == KEY_UP)
+                choice_idx = (choice_idx == 0) ? MENU_ITEMS - 1 : choice_idx - 1;
+            else
+                choice_idx = (choice_idx == MENU_ITEMS - 1) ? 0 : choice_idx + 1;
+            draw_menu_item(choice_idx, 1);
+            ui_update();
+            continue;
+        } else if (ch == 27) {
+            // esc on main menu, write out whatever is still queued
+            ui_close();
+            save_changes(stdscr, 0, 0);
+            return;
+        } else if (ch != '\n') {
+            continue;
+        }
+
+        session_sync(s);
         int choice = choice_idx + 1;
+        WINDOW *page;
+        int amount;
         switch (choice) {
             case 1: // check balance
-                mvwprintw(subwin, 2, 2, "Your balance: %d", balance);
-                wrefresh(subwin);
-                while ((ch = wgetch(subwin)) != 27) { }
-                delwin(subwin);
+                page = page_open();
+                mvwprintw(page, 2, 2, "Your balance: %d", me->balance);
+                page_wait_esc(page);
                 break;
 
-            case 2: { // withdraw
-                mvwprintw(subwin, 2, 2, "Enter amount to withdraw: ");
-                wmove(subwin, 3, 2);
-                wrefresh(subwin);
-                echo();
-                char amt_str[12];
-                noecho();
-                if (read_line_with_esc_in_window(subwin, amt_str, sizeof(amt_str))) {
-                    delwin(subwin);
+            case 2: // withdraw
+                page = page_open();
+                if ((amount = page_read_amount(page, "Enter amount to withdraw: ")) == 0)
                     break;
+                if (amount > 0 && amount > me->balance) {
+                    mvwprintw(page, 5, 2, "Insufficient balance!");
+                } else if (amount > 0) {
+                    int rc = change_balance(s, -amount);
+                    if (rc == PROTO_OK)
+                        mvwprintw(page, 5, 2, "Withdrawal successful! New balance: %d", me->balance);
+                    else if (rc == PROTO_INSUFFICIENT)
+                        mvwprintw(page, 5, 2, "Insufficient balance!");
+                    else
+                        mvwprintw(page, 5, 2, "Withdrawal failed, try again later.");
                 }
-                bool valid_input = true;
-                for (int i = 0; amt_str[i] != '\0'; i++) {
-                    if (!isdigit((unsigned char)amt_str[i])) {
-                        valid_input = false;
-                        break;
-                    }
-                }
-                if (!valid_input) {
-                    mvwprintw(subwin, 5, 2, "Invalid amount. Only numbers allowed!");
-                } else {
-                    int amount = atoi(amt_str);
-                    if (amount <= 0) {
-                        mvwprintw(subwin, 5, 2, "Invalid amount. Must be positive!");
-                    } else if (amount > balance) {
-                        mvwprintw(subwin, 5, 2, "Insufficient balance!");
-                    } else {
-                        balance -= amount;
-                        mvwprintw(subwin, 5, 2, "Withdrawal successful! New balance: %d", balance);
-                        reload_data_and_update(regno, pin, user_name, balance);
-                    }
-                }
-                wrefresh(subwin);
-                while ((ch = wgetch(subwin)) != 27) { }
-                delwin(subwin);
+                page_wait_esc(page);
                 break;
-            }
 
-            case 3: { // deposit
-                mvwprintw(subwin, 2, 2, "Enter amount to deposit: ");
-                wmove(subwin, 3, 2);
-                wrefresh(subwin);
-                echo();
-                char amt_str[12];
-                noecho();
-                if (read_line_with_esc_in_window(subwin, amt_str, sizeof(amt_str))) {
-                    delwin(subwin);
+            case 3: // deposit
+                page = page_open();
+                if ((amount = page_read_amount(page, "Enter amount to deposit: ")) == 0)
                     break;
+                if (amount > 0 && change_balance(s, amount) == PROTO_OK) {
+                    mvwprintw(page, 5, 2, "Deposit successful! New balance: %d", me->balance);
+                } else if (amount > 0) {
+                    mvwprintw(page, 5, 2, "Deposit failed, try again later.");
                 }
-                bool valid_input = true;
-                for (int i = 0; amt_str[i] != '\0'; i++) {
-                    if (!isdigit((unsigned char)amt_str[i])) {
-                        valid_input = false;
-                        break;
-                    }
-                }
-                if (!valid_input) {
-                    mvwprintw(subwin, 5, 2, "Invalid amount. Only numbers allowed!");
-                } else {
-                    int amount = atoi(amt_str);
-                    if (amount <= 0) {
-                        mvwprintw(subwin, 5, 2, "Invalid amount. Must be positive!");
-                    } else {
-                        balance += amount;
-                        mvwprintw(subwin, 5, 2, "Deposit successful! New balance: %d", balance);
-                        reload_data_and_update(regno, pin, user_name, balance);
-                    }
-                }
-                wrefresh(subwin);
-                while ((ch = wgetch(subwin)) != 27) { }
-                delwin(subwin);
+                page_wait_esc(page);
                 break;
-            }
 
             case 4: // exit
-                delwin(subwin);
-                clear();
+                ui_close();
                 mvprintw(0, 0, "Exiting...");
                 refresh();
+                save_changes(stdscr, 1, 0);
                 return;
 
-            case 5: { // account settings
-                int settings_idx = 0;
-                int settings_opts_count = 2;
-                const char *settings_opts[] = {"Change Name", "Change PIN"};
-                while (1) {
-                    // Draw settings menu
-                    for (int i = 0; i < settings_opts_count; i++) {
-                        if (i == settings_idx) wattron(subwin, A_REVERSE);
-                        mvwprintw(subwin, 2 + i, 2, "%d. %s", i + 1, settings_opts[i]);
-                        wattroff(subwin, A_REVERSE);
-                    }
-                    wrefresh(subwin);
-
-                    int c_input = wgetch(subwin);
-                    if (c_input == KEY_UP) {
-                        settings_idx = (settings_idx == 0) ? settings_opts_count - 1 : settings_idx - 1;
-                    } else if (c_input == KEY_DOWN) {
-                        settings_idx = (settings_idx == settings_opts_count - 1) ? 0 : settings_idx + 1;
-                    } else if (c_input == 27) { // ESC
-                        delwin(subwin);
-                        break;
-                    } else if (c_input == '\n') {
-                        // Clear the subwin before entering subsubmenu
-                        wclear(subwin);
-                        wrefresh(subwin);
-
-                        int subsub_h = sub_h;
-                        int subsub_w = sub_w;
-                        WINDOW *subsubwin = derwin(subwin, subsub_h, subsub_w, 0, 0);
-
-                        box(subsubwin, 0, 0);
-                        mvwprintw(subsubwin, 0, subsub_w - 15, "ESC to Go Back");
-                        wrefresh(subsubwin);
-
-                        if (settings_idx == 0) { // Change Name
-                            mvwprintw(subsubwin, 2, 2, "Change Name");
-                            mvwprintw(subsubwin, 3, 2, "Enter your new name:");
-                            wmove(subsubwin, 4, 2);
-                            wrefresh(subsubwin);
-                            echo();
-                            char new_name[50];
-                            noecho();
-                            if (!read_line_with_esc_in_window(subsubwin, new_name, sizeof(new_name))) {
-                                strcpy(user_name, new_name);
-                                mvwprintw(subsubwin, 6, 2, "Name updated to: %s", user_name);
-                                reload_data_and_update(regno, pin, user_name, balance);
-                            }
-                        } else if (settings_idx == 1) { // Change PIN
-                            mvwprintw(subsubwin, 2, 2, "Change PIN");
-                            mvwprintw(subsubwin, 3, 2, "Enter your new PIN (0000-9999):");
-                            wmove(subsubwin, 4, 2);
-                            wrefresh(subsubwin);
-                            echo();
-                            char new_pin_str[10];
-                            noecho();
-                            if (!read_line_with_esc_in_window(subsubwin, new_pin_str, sizeof(new_pin_str))) {
-                                bool valid_pin = true;
-                                int len = strlen(new_pin_str);
-                                for (int i = 0; i < len; i++) {
-                                    if (!isdigit((unsigned char)new_pin_str[i])) {
-                                        valid_pin = false;
-                                        break;
-                                    }
-                                }
-                                if (!valid_pin || len == 0 || len > 4) {
-                                    mvwprintw(subsubwin, 6, 2, "Invalid PIN. Must be 1-4 digits.");
-                                } else {
-                                    int new_pin_val = atoi(new_pin_str);
-                                    if (new_pin_val >= 0 && new_pin_val <= 9999) {
-                                        pin = new_pin_val;
-                                        mvwprintw(subsubwin, 6, 2, "PIN updated to: %d", pin);
-                                        reload_data_and_update(regno, pin, user_name, balance);
-                                    } else {
-                                        mvwprintw(subsubwin, 6, 2, "Invalid PIN. Must be 0000-9999.");
-                                    }
-                                }
-                            }
-                            wrefresh(subsubwin);
-                            while ((c_input = wgetch(subsubwin)) != 27) {}
-                            werase(subsubwin);
-                            wborder(subsubwin, ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ');
-                            wrefresh(subsubwin);
-                            delwin(subsubwin);
-                        }
-                        break;
-                    }
-                }
-                break;
-            }
-            default:
-                delwin(subwin);
+            case 5: // account settings
+                account_settings(s);
                 break;
         }
+        page_close();
     }
 }
 
-int main() {
+// atm --batch: no screen, just the store. the queue is told to hold
+// everything for the one write at the end
+static int run_batch(const char *path) {
+    if (getenv("ATM_SOCKET") && *getenv("ATM_SOCKET")) {
+        fprintf(stderr, "--batch works on the store directly, unset ATM_SOCKET\n");
+        return 1;
+    }
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+    setenv("ATM_FLUSH_MS", "86400000", 1);
+    setenv("ATM_FLUSH_MAX", "1000000000", 1);
+    if (store_open(&store, getenv("ATM_STORE"), &accounts) != 0)
+        return 1;
+    int rc = batch_run(&store, in, strcmp(path, "-") == 0 ? "stdin" : path);
+    if (in != stdin)
+        fclose(in);
+    size_t unsaved = store_close(&store);
+    if (unsaved)
+        fprintf(stderr, "Failed to save changes for %zu account(s)\n", unsaved);
+    account_table_free(&accounts);
+    metrics_finish();
+    return rc == 0 && !unsaved ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
     setlocale(LC_ALL, "");
+    metrics_init();
+    if (argc == 3 && strcmp(argv[1], "--batch") == 0)
+        return run_batch(argv[2]);
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s [--batch FILE|-]\n", argv[0]);
+        return 1;
+    }
+    const char *sock_path = getenv("ATM_SOCKET");
+    remote = sock_path && *sock_path;
+    if (remote) {
+        if (client_connect(sock_path) != 0)
+            return 1;
+    } else {
+        if (store_open(&store, getenv("ATM_STORE"), &accounts) != 0) {
+            return 1;
+        }
+        const char *v = getenv("ATM_REFRESH_MS");
+        if (refresher_start(&store, v && atol(v) > 0 ? atol(v) : REFRESH_MS_DEFAULT) != 0) {
+            store_close(&store);
+            return 1;
+        }
+    }
     // init
-    initscr();
+    FILE *tty_in, *tty_out;
+    if (tty_stats_start(&tty_in, &tty_out) == 0)
+        set_term(newterm(NULL, tty_out, tty_in));
+    else
+        initscr();
     cbreak();
     noecho();
     keypad(stdscr, TRUE);
@@ -586,10 +658,11 @@ int main() {
         wrefresh(loginwin);
 
         // regno
-        echo();
         char regno[20];
-        wgetnstr(loginwin, regno, sizeof(regno) - 1);
-        noecho();
+        login_read(loginwin, regno, sizeof(regno), 0);
+        // start refreshing the account while the PIN is being typed
+        if (!remote)
+            login_ticket = refresher_kick(regno);
 
         // move to pin
         wmove(loginwin, 5, 7);
@@ -597,60 +670,24 @@ int main() {
 
         // pin
         char pin_str[10];
-        int pin_idx = 0;
-        while (1) {
-            int ch = wgetch(loginwin);
-            if (ch == '\n') {
-                pin_str[pin_idx] = '\0';
-                break;
-            } else if (ch == KEY_BACKSPACE || ch == 127) {
-                if (pin_idx > 0) {
-                    pin_idx--;
-                    pin_str[pin_idx] = '\0';
-
-                    int y, x;
-                    getyx(loginwin, y, x);
-                    if (x > 7) {
-                        mvwaddch(loginwin, y, x - 1, ' ');
-                        wmove(loginwin, y, x - 1);
-                    }
-                }
-            } else if (isdigit(ch) && pin_idx < (int)(sizeof(pin_str) - 1)) {
-                pin_str[pin_idx++] = ch;
-                waddch(loginwin, '*');
-            }
-            wrefresh(loginwin);
-        }
+        login_read(loginwin, pin_str, sizeof(pin_str), 1);
 
         int pin = atoi(pin_str);
 
-        char *data = fetch_gist_content();
-        if (!data) {
+        struct session session;
+        int found = authenticate(loginwin, regno, pin, &session);
+        if (found < 0) {
             mvwprintw(loginwin, 7, 2, "Failed to fetch data. Try again.");
             wrefresh(loginwin);
             delwin(loginwin);
             continue;
         }
 
-        int found = 0;
-        char *line = strtok(data, "\n");
-        while (line) {
-            char file_regno[20];
-            int file_pin;
-            sscanf(line, "%[^,],%d", file_regno, &file_pin);
-            if (strcmp(file_regno, regno) == 0 && file_pin == pin) {
-                found = 1;
-                break;
-            }
-            line = strtok(NULL, "\n");
-        }
-        free(data);
-
         if (found) {
             delwin(loginwin);
             clear();
             refresh();
-            process_transaction(regno, pin);
+            process_transaction(&session);
             break;
         } else {
             // mvwprintw(loginwin, 7, 2, "Incorrect Register No or PIN. Try again.");
@@ -660,5 +697,17 @@ int main() {
     }
 
     endwin();
+    tty_stats_stop();
+    if (remote) {
+        client_close();
+        metrics_finish();
+        return 0;
+    }
+    refresher_stop();
+    size_t unsaved = store_close(&store);
+    if (unsaved)
+        fprintf(stderr, "Failed to save changes for %zu account(s)\n", unsaved);
+    account_table_free(&accounts);
+    metrics_finish();
     return 0;
 }
@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "accounts.h"
+#include "metrics.h"
+#include "proto.h"
+#include "store.h"
+
+// atmd: owns the account table and the one store (ATM_STORE), and
+// serves any number of atm terminals over a unix socket (ATM_SOCKET,
+// default ATMD_SOCKET_DEFAULT). changes go through one write queue, so
+// concurrent terminals no longer race each other on the gist
+
+#define MAX_EVENTS 64
+// requests read per client in one go
+#define IN_MSGS 16
+// how often the table is refreshed from the store, ATM_REFRESH_MS
+#define REFRESH_MS_DEFAULT 5000
+// epoll timeout while a flush or a refresh is being waited on
+#define BUSY_POLL_MS 20
+
+struct client {
+    int fd;
+    struct proto_msg in[IN_MSGS];
+    size_t in_len;
+    // replies the socket didn't take yet
+    struct string out;
+    size_t out_off;
+    // logged in as, empty before a successful PROTO_LOGIN
+    char regno[REGNO_LEN];
+    // a PROTO_FLUSH is outstanding. nothing after it is handled until
+    // it has been answered, so replies stay in order
+    int flushing;
+    struct store_ticket ticket;
+    struct proto_msg flush_reply;
+    // what epoll currently watches for
+    uint32_t events;
+    struct client *next;
+};
+
+static struct store store;
+static struct account_table accounts;
+static struct client *clients;
+static int epfd;
+static volatile sig_atomic_t stopping;
+
+// periodic refresh, for the gist a conditional GET, driven from the
+// event loop. the store leaves the table alone while changes are unsaved
+static struct {
+    int running;
+    long long next_ms;
+    long interval_ms;
+} refresh;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static void watch(struct client *c) {
+    struct epoll_event ev = { .data.ptr = c };
+    if (!c->flushing)
+        ev.events |= EPOLLIN;
+    if (c->out.len > c->out_off)
+        ev.events |= EPOLLOUT;
+    if (ev.events != c->events)
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = ev.events;
+}
+
+static void drop_client(struct client *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    for (struct client **p = &clients; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    free(c->out.ptr);
+    free(c);
+}
+
+// returns -1 if the client is gone
+static int send_pending(struct client *c) {
+    while (c->out_off < c->out.len) {
+        ssize_t n = send(c->fd, c->out.ptr + c->out_off, c->out.len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->out_off += n;
+    }
+    c->out.len = c->out_off = 0;
+    return 0;
+}
+
+static void reply(struct client *c, const struct proto_msg *m) {
+    string_append(&c->out, (const char *)m, sizeof(*m));
+}
+
+// handles one request. a flush leaves the client waiting for it
+static void handle(struct client *c, const struct proto_msg *req) {
+    struct proto_msg r = *req;
+    r.status = PROTO_OK;
+    r.regno[REGNO_LEN - 1] = '\0';
+    r.name[NAME_LEN - 1] = '\0';
+
+    if (req->op == PROTO_LOGIN) {
+        struct account *a = account_table_find(&accounts, r.regno);
+        if (!a) {
+            r.status = PROTO_NOT_FOUND;
+        } else if (a->pin != req->pin) {
+            r.status = PROTO_BAD_PIN;
+        } else {
+            memcpy(c->regno, a->regno, sizeof(c->regno));
+            memcpy(r.name, a->name, sizeof(r.name));
+            r.value = a->balance;
+        }
+        reply(c, &r);
+        return;
+    }
+
+    if (req->op == PROTO_FLUSH) {
+        c->flushing = 1;
+        c->ticket = store.ops->flush_start(&store);
+        c->flush_reply = r;
+        return;
+    }
+
+    // everything else changes the row of the logged in user only
+    struct account *a = NULL;
+    if (!c->regno[0] || strcmp(r.regno, c->regno) != 0) {
+        r.status = PROTO_DENIED;
+    } else if (!(a = account_table_find(&accounts, r.regno))) {
+        r.status = PROTO_NOT_FOUND;
+    } else {
+        switch (req->op) {
+        case PROTO_BALANCE:
+            // the store has the last word, the table may be behind it
+            if ((req->value < 0 && a->balance + req->value < 0) ||
+                store.ops->add_balance(&store, a->regno, req->value, a->balance + req->value) != 0)
+                r.status = PROTO_INSUFFICIENT;
+            else
+                a->balance += req->value;
+            r.value = a->balance;
+            break;
+        case PROTO_SET_NAME:
+            memcpy(a->name, r.name, sizeof(a->name));
+            store.ops->set_name(&store, a->regno, a->name);
+            break;
+        case PROTO_SET_PIN:
+            a->pin = req->pin;
+            store.ops->set_pin(&store, a->regno, a->pin);
+            break;
+        default:
+            r.status = PROTO_DENIED;
+            break;
+        }
+    }
+    reply(c, &r);
+}
+
+// handles the complete requests buffered so far
+static void process_input(struct client *c) {
+    size_t n = c->in_len / sizeof(struct proto_msg);
+    size_t i = 0;
+    while (i < n && !c->flushing)
+        handle(c, &c->in[i++]);
+    size_t used = i * sizeof(struct proto_msg);
+    memmove(c->in, (char *)c->in + used, c->in_len - used);
+    c->in_len -= used;
+}
+
+static void client_readable(struct client *c) {
+    for (;;) {
+        if (c->in_len == sizeof(c->in)) {
+            process_input(c);
+            if (c->in_len == sizeof(c->in))
+                break;
+        }
+        ssize_t n = recv(c->fd, (char *)c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n == 0) {
+            drop_client(c);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            drop_client(c);
+            return;
+        }
+        c->in_len += n;
+    }
+    process_input(c);
+}
+
+static void accept_clients(int lfd) {
+    for (;;) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
+        struct client *c = calloc(1, sizeof(*c));
+        if (!c) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        init_string(&c->out);
+        c->next = clients;
+        clients = c;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// answers the flushes that have completed and picks up the requests
+// that were held back behind them
+static void poll_flushes(void) {
+    struct client *next;
+    for (struct client *c = clients; c; c = next) {
+        next = c->next;
+        if (!c->flushing)
+            continue;
+        int rc = store.ops->flush_wait(&store, &c->ticket, 0);
+        if (rc == 0)
+            continue;
+        c->flush_reply.status = rc == 1 ? PROTO_OK : PROTO_FAILED;
+        reply(c, &c->flush_reply);
+        c->flushing = 0;
+        process_input(c);
+    }
+}
+
+// replies go out once per loop iteration, after the changes behind them
+// have been committed in one go
+static void send_replies(void) {
+    int committed = store.ops->commit(&store) == 0;
+    struct client *next;
+    for (struct client *c = clients; c; c = next) {
+        next = c->next;
+        if (c->out.len == c->out_off) {
+            watch(c);
+            continue;
+        }
+        if (!committed || send_pending(c) != 0) {
+            // acknowledging a change we couldn't log would be a lie
+            drop_client(c);
+            continue;
+        }
+        watch(c);
+    }
+}
+
+static int any_flushing(void) {
+    for (struct client *c = clients; c; c = c->next) {
+        if (c->flushing)
+            return 1;
+    }
+    return 0;
+}
+
+static void poll_refresh(void) {
+    if (!refresh.running) {
+        if (now_ms() < refresh.next_ms)
+            return;
+        if (store.ops->refresh_start(&store, NULL) != 0) {
+            refresh.next_ms = now_ms() + refresh.interval_ms;
+            return;
+        }
+        refresh.running = 1;
+    }
+    if (!store.ops->refresh_step(&store, -1, 0))
+        return;
+    refresh.running = 0;
+    refresh.next_ms = now_ms() + refresh.interval_ms;
+    store.ops->refresh_finish(&store);
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(void) {
+    const char *path = getenv("ATM_SOCKET");
+    if (!path || !*path)
+        path = ATMD_SOCKET_DEFAULT;
+    const char *v = getenv("ATM_REFRESH_MS");
+    refresh.interval_ms = v && atol(v) > 0 ? atol(v) : REFRESH_MS_DEFAULT;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    metrics_init();
+
+    if (store_open(&store, getenv("ATM_STORE"), &accounts) != 0)
+        return 1;
+    if (store_refresh(&store) != 0) {
+        if (!store.generation) {
+            fprintf(stderr, "Failed to retrieve data\n");
+            store_close(&store);
+            return 1;
+        }
+        fprintf(stderr, "Failed to retrieve data, serving the cached accounts\n");
+    }
+    refresh.next_ms = now_ms() + refresh.interval_ms;
+
+    int lfd = listen_on(path);
+    if (lfd < 0)
+        return 1;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+    fprintf(stderr, "atmd: %zu accounts, listening on %s\n", accounts.count, path);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopping) {
+        long long wait = refresh.next_ms - now_ms();
+        if (refresh.running || any_flushing() || wait < BUSY_POLL_MS)
+            wait = BUSY_POLL_MS;
+        int n = epoll_wait(epfd, events, MAX_EVENTS, (int)wait);
+        for (int i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            if (!c) {
+                accept_clients(lfd);
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                drop_client(c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (send_pending(c) != 0) {
+                    drop_client(c);
+                    continue;
+                }
+                watch(c);
+            }
+            if (events[i].events & EPOLLIN)
+                client_readable(c);
+        }
+        poll_flushes();
+        send_replies();
+        poll_refresh();
+        metrics_poll();
+    }
+
+    while (clients)
+        drop_client(clients);
+    close(lfd);
+    close(epfd);
+    unlink(path);
+    if (refresh.running)
+        store.ops->refresh_cancel(&store);
+    size_t unsaved = store_close(&store);
+    if (unsaved)
+        fprintf(stderr, "Failed to save changes for %zu account(s)\n", unsaved);
+    account_table_free(&accounts);
+    metrics_finish();
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+
+// how long to wait for the write between checks, and how many failed
+// attempts to sit through before giving up. the queue keeps retrying in
+// the background meanwhile
+#define SAVE_WAIT_MS 1000
+#define SAVE_ATTEMPTS 5
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// splits "op,regno,amount". returns NULL if the line is fine, else why
+// it isn't
+static const char *parse(char *line, char *op, char **regno, long *amount) {
+    size_t len = strcspn(line, "\r\n");
+    line[len] = '\0';
+    char *comma = strchr(line, ',');
+    if (!comma || comma - line != 1 || (line[0] != 'D' && line[0] != 'W'))
+        return "expected D,regno,amount or W,regno,amount";
+    *op = line[0];
+    *regno = comma + 1;
+    comma = strchr(*regno, ',');
+    if (!comma || comma == *regno)
+        return "expected D,regno,amount or W,regno,amount";
+    *comma = '\0';
+    if (strlen(*regno) >= REGNO_LEN)
+        return "unknown regno";
+
+    char *end;
+    errno = 0;
+    *amount = strtol(comma + 1, &end, 10);
+    if (end == comma + 1 || *end || errno || *amount <= 0 || *amount > INT_MAX)
+        return "amount must be a positive whole number";
+    return NULL;
+}
+
+static int save(struct store *s) {
+    if (s->ops->commit(s) != 0) {
+        fprintf(stderr, "Failed to commit changes\n");
+        return -1;
+    }
+    struct store_ticket t = s->ops->flush_start(s);
+    int failures = 0, rc;
+    while ((rc = s->ops->flush_wait(s, &t, SAVE_WAIT_MS)) != 1) {
+        if (rc < 0 && ++failures >= SAVE_ATTEMPTS)
+            return -1;
+    }
+    return 0;
+}
+
+int batch_run(struct store *s, FILE *in, const char *name) {
+    long long t0 = now_us();
+    if (store_refresh(s) != 0) {
+        if (!s->generation) {
+            fprintf(stderr, "Failed to retrieve data\n");
+            return -1;
+        }
+        fprintf(stderr, "Failed to retrieve data, working on the cached accounts\n");
+    }
+    long long t1 = now_us();
+
+    char *line = NULL;
+    size_t cap = 0;
+    unsigned long lineno = 0, applied = 0, rejected = 0;
+    long long deposited = 0, withdrawn = 0;
+    while (getline(&line, &cap, in) != -1) {
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#')
+            continue;
+
+        char op;
+        char *regno;
+        long amount;
+        const char *err = parse(line, &op, &regno, &amount);
+        // the table is only refreshed again after the batch, so the rows
+        // are updated in place and later lines see earlier ones
+        struct account *a = err ? NULL : account_table_find(s->table, regno);
+        if (!err && !a)
+            err = "unknown regno";
+        else if (!err && op == 'W' && amount > a->balance)
+            err = "insufficient funds";
+        else if (!err && op == 'D' && amount > INT_MAX - a->balance)
+            err = "balance would overflow";
+        if (err) {
+            fprintf(stderr, "%s:%lu: %s\n", name, lineno, err);
+            rejected++;
+            continue;
+        }
+
+        int delta = op == 'D' ? (int)amount : -(int)amount;
+        if (s->ops->add_balance(s, a->regno, delta, a->balance + delta) != 0) {
+            fprintf(stderr, "%s:%lu: insufficient funds\n", name, lineno);
+            rejected++;
+            continue;
+        }
+        a->balance += delta;
+        applied++;
+        if (delta > 0)
+            deposited += delta;
+        else
+            withdrawn -= delta;
+    }
+    free(line);
+    if (ferror(in)) {
+        perror(name);
+        return -1;
+    }
+    long long t2 = now_us();
+
+    int rc = applied ? save(s) : 0;
+    long long t3 = now_us();
+    if (rc != 0)
+        fprintf(stderr, "Failed to save the batch, it stays queued\n");
+
+    double apply_s = (t2 - t1) / 1e6, total_s = (t3 - t0) / 1e6;
+    printf("%lu applied, %lu rejected: %lld deposited, %lld withdrawn\n", applied, rejected,
+           deposited, withdrawn);
+    printf("load %.1f ms, apply %.1f ms, save %.1f ms\n", (t1 - t0) / 1e3, (t2 - t1) / 1e3,
+           (t3 - t2) / 1e3);
+    printf("%.0f transactions/s applied, %.0f/s end to end\n",
+           apply_s > 0 ? applied / apply_s : 0, total_s > 0 ? applied / total_s : 0);
+    return rc;
+}
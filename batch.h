@@ -0,0 +1,24 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+#include "store.h"
+
+// atm --batch FILE (or - for stdin): applies a file of transactions in
+// one pass, without the menu. one per line,
+//
+//   D,regno,amount   deposit
+//   W,regno,amount   withdrawal
+//
+// blank lines and lines starting with '#' are skipped. every line is
+// checked against the rows as they stand after the lines before it:
+// unknown regnos, malformed lines and withdrawals over the balance are
+// reported on stderr and left out. whatever passed is committed and
+// written in one go, and the throughput is reported on stdout.
+//
+// s must be open. returns 0 if everything that passed was saved
+
+int batch_run(struct store *s, FILE *in, const char *name);
+
+#endif
@@ -0,0 +1,171 @@
+// counts heap allocations per login. the original fetch path (fresh easy
+// handle and header list, realloc per chunk, json_tokener_parse, strdup,
+// strtok/sscanf scan) is run side by side with gist_fetch() feeding the
+// arena backed account table. the gist is served from a file:// url so
+// the numbers are not disturbed by a server.
+//
+// usage: bench/alloc_bench [accounts] [logins]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <json-c/json.h>
+
+#include "../accounts.h"
+#include "../gist.h"
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static unsigned long allocs;
+
+void *malloc(size_t n) {
+    allocs++;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+    allocs++;
+    return __libc_realloc(p, n);
+}
+
+void free(void *p) {
+    __libc_free(p);
+}
+
+#define BENCH_FILE "/tmp/atm_alloc_bench.json"
+
+// a gist document shaped like the real api reply, metadata included
+static void write_gist(long accounts) {
+    FILE *f = fopen(BENCH_FILE, "w");
+    if (!f) {
+        perror(BENCH_FILE);
+        exit(1);
+    }
+    fprintf(f, "{\"url\": \"https://api.github.com/gists/0\", \"id\": \"0\", "
+               "\"node_id\": \"G_0\", \"public\": false, \"created_at\": \"2024-01-01T00:00:00Z\", "
+               "\"updated_at\": \"2024-01-01T00:00:00Z\", \"description\": \"\", \"comments\": 0, "
+               "\"owner\": {\"login\": \"atm\", \"id\": 1, \"type\": \"User\", \"site_admin\": false}, "
+               "\"files\": {\"" FILE_NAME "\": {\"filename\": \"" FILE_NAME "\", "
+               "\"type\": \"text/csv\", \"language\": \"CSV\", \"truncated\": false, \"content\": \"");
+    for (long i = 0; i < accounts; i++)
+        fprintf(f, "R%07ld,%ld,Name %ld,%ld\\n", i, i % 10000, i, i * 3);
+    fprintf(f, "\"}}, \"history\": [{\"version\": \"0\", \"committed_at\": \"2024-01-01T00:00:00Z\", "
+               "\"change_status\": {\"total\": 1, \"additions\": 1, \"deletions\": 0}}], "
+               "\"truncated\": false}\n");
+    fclose(f);
+}
+
+static size_t legacy_writefunc(void *ptr, size_t size, size_t nmemb, struct string *s) {
+    size_t new_len = s->len + size * nmemb;
+    s->ptr = realloc(s->ptr, new_len + 1);
+    memcpy(s->ptr + s->len, ptr, size * nmemb);
+    s->ptr[new_len] = '\0';
+    s->len = new_len;
+    return size * nmemb;
+}
+
+static int legacy_login(const char *regno, int pin) {
+    CURL *curl = curl_easy_init();
+    struct string response = { malloc(1), 0, 1 };
+    response.ptr[0] = '\0';
+
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, "Authorization: token " GITHUB_TOKEN);
+    headers = curl_slist_append(headers, "User-Agent: ATM-Simulator");
+    curl_easy_setopt(curl, CURLOPT_URL, "file://" BENCH_FILE);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, legacy_writefunc);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+
+    struct json_object *parsed_json = json_tokener_parse(response.ptr);
+    struct json_object *files, *file_content, *content;
+    json_object_object_get_ex(parsed_json, "files", &files);
+    json_object_object_get_ex(files, FILE_NAME, &file_content);
+    json_object_object_get_ex(file_content, "content", &content);
+    char *data = strdup(json_object_get_string(content));
+    json_object_put(parsed_json);
+    free(response.ptr);
+
+    int found = 0;
+    char *line = strtok(data, "\n");
+    while (line) {
+        char file_regno[20];
+        int file_pin;
+        sscanf(line, "%[^,],%d", file_regno, &file_pin);
+        if (strcmp(file_regno, regno) == 0 && file_pin == pin) {
+            found = 1;
+            break;
+        }
+        line = strtok(NULL, "\n");
+    }
+    free(data);
+    return found;
+}
+
+static struct account_table table;
+
+static void load_table(const char *content, void *arg) {
+    (void)arg;
+    account_table_load(&table, content);
+}
+
+static int arena_login(const char *regno, int pin) {
+    if (!fetch_gist_content())
+        return 0;
+    struct account *a = account_table_find(&table, regno);
+    return a && a->pin == pin;
+}
+
+int main(int argc, char **argv) {
+    long accounts = argc > 1 ? atol(argv[1]) : 10000;
+    int logins = argc > 2 ? atoi(argv[2]) : 20;
+    if (accounts < 1 || logins < 1) {
+        fprintf(stderr, "usage: %s [accounts] [logins]\n", argv[0]);
+        return 1;
+    }
+
+    write_gist(accounts);
+    setenv("ATM_API_URL", "file://" BENCH_FILE, 1);
+    if (gist_global_init() != 0)
+        return 1;
+    gist_set_content_handler(load_table, NULL);
+
+    char regno[32];
+    snprintf(regno, sizeof(regno), "R%07ld", accounts - 1);
+    int pin = (int)((accounts - 1) % 10000);
+
+    // first round warms up both paths (curl and arena first-time setup)
+    legacy_login(regno, pin);
+    arena_login(regno, pin);
+
+    unsigned long before = allocs;
+    int ok = 1;
+    for (int i = 0; i < logins; i++)
+        ok &= legacy_login(regno, pin);
+    unsigned long legacy = allocs - before;
+
+    before = allocs;
+    for (int i = 0; i < logins; i++)
+        ok &= arena_login(regno, pin);
+    unsigned long arena = allocs - before;
+
+    printf("accounts: %ld, logins: %d%s\n", accounts, logins, ok ? "" : " (LOOKUP FAILED)");
+    printf("legacy fetch path: %8.1f allocations per login\n", (double)legacy / logins);
+    printf("arena fetch path:  %8.1f allocations per login\n", (double)arena / logins);
+
+    account_table_free(&table);
+    gist_global_cleanup();
+    remove(BENCH_FILE);
+    return ok ? 0 : 1;
+}
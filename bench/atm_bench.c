@@ -0,0 +1,222 @@
+// headless run of the atm flows against the in-process stand-in for the
+// gists api (mock_gist.h). every session logs in, checks its balance,
+// withdraws, deposits and saves, through the same store and write queue
+// the terminal uses, with ncurses out of the picture. the run is
+// deterministic for a given set of flags.
+//
+// prints a summary and writes the numbers as json to the -o file, so
+// runs of two builds can be compared.
+//
+// usage: bench/atm_bench [-a accounts] [-s sessions] [-l latency_ms]
+//                        [-k shards] [-p padding] [-o results.json]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../accounts.h"
+#include "../metrics.h"
+#include "../store.h"
+#include "../strbuf.h"
+#include "mock_gist.h"
+
+#define WITHDRAW 10
+#define DEPOSIT 25
+
+enum { OP_LOGIN, OP_BALANCE, OP_WITHDRAW, OP_DEPOSIT, OP_SAVE, OP_SESSION, OP_COUNT };
+static const char *const op_names[OP_COUNT] = {
+    "login", "balance", "withdraw", "deposit", "save", "session",
+};
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank
+static double percentile(const double *sorted, size_t n, double p) {
+    if (!n)
+        return 0;
+    size_t k = (size_t)(p / 100 * n + 0.5);
+    if (k < 1)
+        k = 1;
+    if (k > n)
+        k = n;
+    return sorted[k - 1];
+}
+
+static struct store store;
+static struct account_table accounts;
+
+static int login(const char *regno, int pin, struct account *out) {
+    if (store.ops->refresh_start(&store, regno) != 0)
+        return -1;
+    while (!store.ops->refresh_step(&store, -1, 100))
+        ;
+    if (store.ops->refresh_finish(&store) != 0)
+        return -1;
+    struct account *a = account_table_find(&accounts, regno);
+    if (!a || a->pin != pin)
+        return -1;
+    *out = *a;
+    return 0;
+}
+
+static int save(void) {
+    struct store_ticket t = store.ops->flush_start(&store);
+    int rc;
+    while ((rc = store.ops->flush_wait(&store, &t, 1000)) == 0)
+        ;
+    return rc == 1 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    struct mock_gist_config cfg = { .latency_ms = 2, .accounts = 10000, .shards = 1 };
+    long sessions = 200;
+    const char *out_path = "bench/results.json";
+    int opt;
+    while ((opt = getopt(argc, argv, "a:s:l:k:p:o:")) != -1) {
+        switch (opt) {
+        case 'a': cfg.accounts = atol(optarg); break;
+        case 's': sessions = atol(optarg); break;
+        case 'l': cfg.latency_ms = atoi(optarg); break;
+        case 'k': cfg.shards = (size_t)atol(optarg); break;
+        case 'p': cfg.padding = (size_t)atol(optarg); break;
+        case 'o': out_path = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-a accounts] [-s sessions] [-l latency_ms] "
+                            "[-k shards] [-p padding] [-o results.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.accounts < 1 || sessions < 1 || cfg.shards < 1) {
+        fprintf(stderr, "accounts, sessions and shards must be positive\n");
+        return 1;
+    }
+
+    int port = mock_gist_start(&cfg);
+    if (port < 0)
+        return 1;
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/gists/0", port);
+    setenv("ATM_API_URL", url, 1);
+    if (cfg.shards > 1) {
+        struct string urls;
+        init_string(&urls);
+        for (size_t k = 0; k < cfg.shards; k++) {
+            snprintf(url, sizeof(url), "%shttp://127.0.0.1:%d/gists/%zu", k ? "," : "", port, k);
+            string_append_str(&urls, url);
+        }
+        setenv("ATM_SHARD_URLS", urls.ptr, 1);
+        free(urls.ptr);
+    }
+    // saves are explicit, like pressing Exit in the terminal
+    setenv("ATM_FLUSH_MS", "600000", 0);
+    long long expected = mock_gist_total_balance() + (long long)sessions * (DEPOSIT - WITHDRAW);
+
+    if (store_open(&store, getenv("ATM_STORE"), &accounts) != 0)
+        return 1;
+
+    double *samples[OP_COUNT];
+    for (int op = 0; op < OP_COUNT; op++) {
+        samples[op] = malloc(sessions * sizeof(double));
+        if (!samples[op]) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 1;
+        }
+    }
+
+    long failures = 0;
+    double start = now_us();
+    for (long i = 0; i < sessions; i++) {
+        char regno[REGNO_LEN];
+        int pin, balance;
+        mock_gist_row((i * 7919) % cfg.accounts, regno, sizeof(regno), &pin, &balance);
+
+        struct account me;
+        double t0 = now_us();
+        if (login(regno, pin, &me) != 0) {
+            failures++;
+            continue;
+        }
+        double t1 = now_us();
+        volatile int seen = me.balance;
+        (void)seen;
+        double t2 = now_us();
+        me.balance -= WITHDRAW;
+        store.ops->add_balance(&store, me.regno, -WITHDRAW, me.balance);
+        failures += store.ops->commit(&store) != 0;
+        double t3 = now_us();
+        me.balance += DEPOSIT;
+        store.ops->add_balance(&store, me.regno, DEPOSIT, me.balance);
+        failures += store.ops->commit(&store) != 0;
+        double t4 = now_us();
+        failures += save() != 0;
+        double t5 = now_us();
+
+        samples[OP_LOGIN][i] = t1 - t0;
+        samples[OP_BALANCE][i] = t2 - t1;
+        samples[OP_WITHDRAW][i] = t3 - t2;
+        samples[OP_DEPOSIT][i] = t4 - t3;
+        samples[OP_SAVE][i] = t5 - t4;
+        samples[OP_SESSION][i] = t5 - t0;
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    int checked = store.ops == &store_gist_ops;
+    size_t unsaved = store_close(&store);
+    long long total = mock_gist_total_balance();
+    struct mock_gist_stats st;
+    mock_gist_get_stats(&st);
+
+    long done = sessions - failures;
+    printf("accounts %ld, sessions %ld, latency %d ms, shards %zu, %s store\n",
+           cfg.accounts, sessions, cfg.latency_ms, cfg.shards, checked ? "gist" : "file");
+    printf("%-9s %12s %12s\n", "op", "p50 us", "p99 us");
+    FILE *f = fopen(out_path, "w");
+    if (!f)
+        perror(out_path);
+    if (f) {
+        fprintf(f, "{\n  \"accounts\": %ld,\n  \"sessions\": %ld,\n  \"latency_ms\": %d,\n"
+                   "  \"shards\": %zu,\n  \"padding\": %zu,\n  \"ops\": {\n",
+                cfg.accounts, sessions, cfg.latency_ms, cfg.shards, cfg.padding);
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        size_t n = failures ? 0 : (size_t)sessions;
+        qsort(samples[op], n, sizeof(double), cmp_double);
+        double p50 = percentile(samples[op], n, 50), p99 = percentile(samples[op], n, 99);
+        printf("%-9s %12.1f %12.1f\n", op_names[op], p50, p99);
+        if (f)
+            fprintf(f, "    \"%s\": { \"p50_us\": %.1f, \"p99_us\": %.1f }%s\n",
+                    op_names[op], p50, p99, op + 1 < OP_COUNT ? "," : "");
+        free(samples[op]);
+    }
+    printf("throughput %.1f sessions/s, %lu requests (%lu GET, %lu 304, %lu PATCH, %lu 412)\n",
+           done / elapsed, st.requests, st.gets, st.not_modified, st.patches, st.conflicts);
+    printf("bytes in %llu, out %llu, %.0f per session\n", st.bytes_in, st.bytes_out,
+           (double)(st.bytes_in + st.bytes_out) / (done ? done : 1));
+    printf("\nwhere the time went:\n");
+    metrics_write_text(stdout);
+    int balanced = !checked || total == expected;
+    if (checked)
+        printf("balance check %s (expected %lld, found %lld)\n", balanced ? "ok" : "FAILED",
+               expected, total);
+    if (f) {
+        fprintf(f, "  },\n  \"failures\": %ld,\n  \"unsaved\": %zu,\n  \"elapsed_s\": %.3f,\n"
+                   "  \"sessions_per_s\": %.1f,\n  \"requests\": %lu,\n  \"gets\": %lu,\n"
+                   "  \"not_modified\": %lu,\n  \"patches\": %lu,\n  \"conflicts\": %lu,\n"
+                   "  \"bytes_in\": %llu,\n  \"bytes_out\": %llu,\n  \"balance_ok\": %s\n}\n",
+                failures, unsaved, elapsed, done / elapsed, st.requests, st.gets,
+                st.not_modified, st.patches, st.conflicts, st.bytes_in, st.bytes_out,
+                balanced ? "true" : "false");
+        fclose(f);
+    }
+    return failures || unsaved || !balanced ? 1 : 0;
+}
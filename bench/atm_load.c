@@ -0,0 +1,343 @@
+// many terminals writing to the same gists at once. every worker thread
+// is a terminal of its own, with its own connections and its own copy
+// of the table, running sessions against the in-process mock gist
+// (mock_gist.h): log in, withdraw, deposit, save. saving is one of
+//
+//   cas        what atm does: PATCH with If-Match, and on 412 reread
+//              the gist, reapply the change and try again
+//   overwrite  what atm used to do: reread the gist, apply the change,
+//              PATCH it over whatever is there by then
+//
+// at the end the balances on the mock are summed and compared with
+// what the saved changes add up to, so updates lost to a race show up.
+// -q gives the mock a quota of that many requests a second, answered
+// with 403s (or 429s with -Q 429) once it is spent, to see how the
+// client's rate limiting (gist.h) holds up; -R leaves out the header
+// saying when the quota comes back. -f puts another file in every gist
+// after the accounts, which has to be left out of them. -c makes the
+// run a test for make check: it fails unless some reads came back 304,
+// the quota (if any) was hit, and every session still went through,
+// and it fails if it takes over CHECK_TIMEOUT_S seconds.
+//
+// usage: bench/atm_load [-t threads] [-s sessions per thread]
+//                       [-a accounts] [-l latency_ms] [-k shards]
+//                       [-m cas|overwrite] [-q quota] [-Q 403|429] [-R]
+//                       [-f] [-c]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../accounts.h"
+#include "../gist.h"
+#include "../strbuf.h"
+#include "mock_gist.h"
+
+#define WITHDRAW 10
+#define DEPOSIT 25
+// a save still conflicting after this many rereads is given up on
+#define ATTEMPTS 100
+// a -c run stuck for this long is killed by SIGALRM, which fails it
+#define CHECK_TIMEOUT_S 120
+
+struct worker {
+    pthread_t thread;
+    unsigned seed;
+    struct gist_conn *conns;
+    struct account_table table;
+    struct string csv;
+    // microseconds per session, and per save
+    double *session_us;
+    double *save_us;
+    long done;
+    long failed;
+    // saves that went through, and the balance they added
+    long saved;
+    long long added;
+    unsigned long conflicts;
+    unsigned long retries;
+    unsigned long gave_up;
+};
+
+static struct {
+    long sessions;
+    long accounts;
+    int overwrite;
+    size_t shards;
+} cfg;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank
+static double percentile(const double *sorted, size_t n, double p) {
+    if (!n)
+        return 0;
+    size_t k = (size_t)(p / 100 * n + 0.5);
+    if (k < 1)
+        k = 1;
+    if (k > n)
+        k = n;
+    return sorted[k - 1];
+}
+
+static int reread(struct worker *w, struct gist_conn *c) {
+    const char *content = gist_fetch(c);
+    if (!content)
+        return -1;
+    account_table_load(&w->table, content);
+    return 0;
+}
+
+// returns the gist_update result of the last attempt
+static int save(struct worker *w, struct gist_conn *c, const char *regno, int delta) {
+    for (int attempt = 0; attempt < ATTEMPTS; attempt++) {
+        if (attempt)
+            w->retries++;
+        // the overwrite path always rereads right before writing, and
+        // still loses whatever lands between the two
+        if ((attempt || cfg.overwrite) && reread(w, c) != 0)
+            return GIST_ERROR;
+        struct account *a = account_table_find(&w->table, regno);
+        if (!a)
+            return GIST_ERROR;
+        a->balance += delta;
+        w->csv.len = 0;
+        account_table_append_csv(&w->table, &w->csv);
+        int rc = cfg.overwrite ? gist_update(c, w->csv.ptr) : gist_update_if_match(c, w->csv.ptr);
+        if (rc != GIST_CONFLICT)
+            return rc;
+        w->conflicts++;
+    }
+    w->gave_up++;
+    return GIST_CONFLICT;
+}
+
+static int session(struct worker *w, double *save_us) {
+    char regno[REGNO_LEN];
+    int pin, balance;
+    mock_gist_row(rand_r(&w->seed) % cfg.accounts, regno, sizeof(regno), &pin, &balance);
+    struct gist_conn *c = &w->conns[gist_shard_of(regno)];
+
+    // login: the terminal revalidates its copy before checking the pin
+    if (reread(w, c) != 0)
+        return -1;
+    const struct account *a = account_table_find(&w->table, regno);
+    if (!a || a->pin != pin)
+        return -1;
+    int delta = 0;
+    if (a->balance >= WITHDRAW)
+        delta -= WITHDRAW;
+    delta += DEPOSIT;
+
+    double t0 = now_us();
+    int rc = save(w, c, regno, delta);
+    *save_us = now_us() - t0;
+    if (rc != GIST_OK)
+        return -1;
+    w->saved++;
+    w->added += delta;
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    for (long i = 0; i < cfg.sessions; i++) {
+        double t0 = now_us(), save_us;
+        if (session(w, &save_us) != 0) {
+            w->failed++;
+            continue;
+        }
+        w->session_us[w->done] = now_us() - t0;
+        w->save_us[w->done] = save_us;
+        w->done++;
+    }
+    return NULL;
+}
+
+static void *alloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (!p) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void report(const char *what, double *v, size_t n) {
+    qsort(v, n, sizeof(double), cmp_double);
+    printf("%-8s p50 %10.1f  p99 %10.1f  p99.9 %10.1f  max %10.1f us\n", what,
+           percentile(v, n, 50), percentile(v, n, 99), percentile(v, n, 99.9),
+           n ? v[n - 1] : 0);
+}
+
+int main(int argc, char **argv) {
+    struct mock_gist_config mock = { .latency_ms = 2, .accounts = 1000, .shards = 1 };
+    size_t threads = 50;
+    cfg.sessions = 20;
+    const char *mode = "cas";
+    mock.limit_status = 403;
+    int check = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:a:l:k:m:q:Q:Rfc")) != -1) {
+        switch (opt) {
+        case 't': threads = (size_t)atol(optarg); break;
+        case 's': cfg.sessions = atol(optarg); break;
+        case 'a': mock.accounts = atol(optarg); break;
+        case 'l': mock.latency_ms = atoi(optarg); break;
+        case 'k': mock.shards = (size_t)atol(optarg); break;
+        case 'm': mode = optarg; break;
+        case 'q': mock.quota = atol(optarg); break;
+        case 'Q': mock.limit_status = atoi(optarg); break;
+        case 'R': mock.no_reset = 1; break;
+        case 'f': mock.other_file = 1; break;
+        case 'c': check = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-s sessions per thread] [-a accounts] "
+                            "[-l latency_ms] [-k shards] [-m cas|overwrite] [-q quota] "
+                            "[-Q 403|429] [-R] [-f] [-c]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (strcmp(mode, "cas") != 0 && strcmp(mode, "overwrite") != 0) {
+        fprintf(stderr, "Unknown mode: %s\n", mode);
+        return 1;
+    }
+    if (mock.limit_status != 403 && mock.limit_status != 429) {
+        fprintf(stderr, "-Q takes 403 or 429\n");
+        return 1;
+    }
+    if (threads < 1 || cfg.sessions < 1 || mock.accounts < 1 || mock.shards < 1) {
+        fprintf(stderr, "threads, sessions, accounts and shards must be positive\n");
+        return 1;
+    }
+    if (check)
+        alarm(CHECK_TIMEOUT_S);
+    cfg.overwrite = strcmp(mode, "overwrite") == 0;
+    cfg.accounts = mock.accounts;
+    cfg.shards = mock.shards;
+
+    int port = mock_gist_start(&mock);
+    if (port < 0)
+        return 1;
+    struct string urls;
+    init_string(&urls);
+    for (size_t k = 0; k < mock.shards; k++) {
+        char url[64];
+        snprintf(url, sizeof(url), "%shttp://127.0.0.1:%d/gists/%zu", k ? "," : "", port, k);
+        string_append_str(&urls, url);
+        if (k == 0)
+            setenv("ATM_API_URL", url, 1);
+    }
+    if (mock.shards > 1)
+        setenv("ATM_SHARD_URLS", urls.ptr, 1);
+    if (gist_global_init() != 0)
+        return 1;
+    long long before = mock_gist_total_balance();
+
+    struct worker *workers = alloc(threads, sizeof(*workers));
+    for (size_t i = 0; i < threads; i++) {
+        struct worker *w = &workers[i];
+        w->seed = (unsigned)i + 1;
+        w->conns = alloc(mock.shards, sizeof(*w->conns));
+        for (size_t k = 0; k < mock.shards; k++) {
+            if (gist_conn_init(&w->conns[k]) != 0)
+                return 1;
+            gist_conn_set_shard(&w->conns[k], k);
+        }
+        init_string(&w->csv);
+        w->session_us = alloc(cfg.sessions, sizeof(double));
+        w->save_us = alloc(cfg.sessions, sizeof(double));
+    }
+
+    double start = now_us();
+    for (size_t i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start worker\n");
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    size_t n = 0;
+    double *session_us = alloc(threads * cfg.sessions, sizeof(double));
+    double *save_us = alloc(threads * cfg.sessions, sizeof(double));
+    long failed = 0, saved = 0;
+    long long added = 0;
+    unsigned long conflicts = 0, retries = 0, gave_up = 0;
+    for (size_t i = 0; i < threads; i++) {
+        struct worker *w = &workers[i];
+        memcpy(session_us + n, w->session_us, w->done * sizeof(double));
+        memcpy(save_us + n, w->save_us, w->done * sizeof(double));
+        n += w->done;
+        failed += w->failed;
+        saved += w->saved;
+        added += w->added;
+        conflicts += w->conflicts;
+        retries += w->retries;
+        gave_up += w->gave_up;
+        for (size_t k = 0; k < mock.shards; k++)
+            gist_conn_cleanup(&w->conns[k]);
+        free(w->conns);
+        account_table_free(&w->table);
+        free(w->csv.ptr);
+        free(w->session_us);
+        free(w->save_us);
+    }
+    struct gist_rate_stats rs;
+    gist_get_rate_stats(&rs);
+    gist_global_cleanup();
+
+    long long expected = before + added, total = mock_gist_total_balance();
+    struct mock_gist_stats st;
+    mock_gist_get_stats(&st);
+    printf("%zu threads x %ld sessions, %ld accounts, %d ms latency, %zu shards, %s\n", threads,
+           cfg.sessions, mock.accounts, mock.latency_ms, mock.shards, mode);
+    printf("%zu sessions in %.2f s, %.1f sessions/s, %ld failed\n", n, elapsed, n / elapsed, failed);
+    report("session", session_us, n);
+    report("save", save_us, n);
+    printf("conflicts %lu, retries %lu, gave up %lu, %.2f attempts per save\n", conflicts, retries,
+           gave_up, saved ? (double)(saved + retries) / saved : 0);
+    printf("requests %lu (%lu GET, %lu 304, %lu PATCH, %lu 412, %lu over quota)\n", st.requests,
+           st.gets, st.not_modified, st.patches, st.conflicts, st.throttled);
+    printf("client: %lu sent, %lu rate limited, %lu retried, %lu coalesced, %lu reads held back\n",
+           rs.requests, rs.throttled, rs.retries, rs.coalesced, rs.deferred);
+    long long lost = expected - total;
+    printf("balance check %s: expected %lld, found %lld", lost ? "FAILED" : "ok", expected, total);
+    if (lost)
+        printf(", %lld lost", lost);
+    printf("\n");
+    int missed = 0;
+    if (check) {
+        if (!st.not_modified) {
+            printf("check FAILED: no read came back 304\n");
+            missed = 1;
+        }
+        if (mock.quota && !st.throttled) {
+            printf("check FAILED: the quota was never hit\n");
+            missed = 1;
+        }
+        if (failed) {
+            printf("check FAILED: %ld sessions failed\n", failed);
+            missed = 1;
+        }
+    }
+    free(session_us);
+    free(save_us);
+    free(workers);
+    free(urls.ptr);
+    return lost || missed ? 1 : 0;
+}
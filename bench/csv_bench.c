@@ -0,0 +1,114 @@
+// compares the csv parser against the strtok + sscanf("%[^,],%d,%[^,],%d")
+// loop it replaced, on generated nfc_data.csv content.
+//
+// usage: bench/csv_bench [rows ...]     (default 10000 1000000 10000000)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../csv.h"
+#include "../strbuf.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void generate(struct string *s, long rows) {
+    s->len = 0;
+    string_reserve(s, rows * 32);
+    for (long i = 0; i < rows; i++) {
+        string_append(s, "CB.EN.U4ECE", 11);
+        string_append_int(s, 23000 + i);
+        string_append(s, ",", 1);
+        string_append_int(s, i % 10000);
+        string_append(s, ",Student ", 9);
+        string_append_int(s, i);
+        string_append(s, ",", 1);
+        string_append_int(s, (i * 7919) % 100000);
+        string_append(s, "\n", 1);
+    }
+}
+
+// checksum keeps the compiler from dropping the work
+static long run_sscanf(const char *data, size_t len, long *sum) {
+    char *copy = malloc(len + 1);
+    memcpy(copy, data, len + 1);
+    long rows = 0;
+    char *line = strtok(copy, "\n");
+    while (line) {
+        char file_regno[20], file_name[50];
+        int file_pin, file_balance;
+        if (sscanf(line, "%[^,],%d,%[^,],%d", file_regno, &file_pin, file_name, &file_balance) == 4) {
+            rows++;
+            *sum += file_balance + file_pin + file_regno[0] + file_name[0];
+        }
+        line = strtok(NULL, "\n");
+    }
+    free(copy);
+    return rows;
+}
+
+static long run_reader(const char *data, size_t len, long *sum) {
+    struct csv_reader r;
+    struct csv_record rec;
+    long rows = 0;
+    int rc;
+    csv_reader_init(&r, data, len);
+    while ((rc = csv_read(&r, &rec)) != 0) {
+        if (rc < 0)
+            continue;
+        rows++;
+        *sum += rec.balance + rec.pin + rec.regno.ptr[0] + rec.name.ptr[0];
+    }
+    return rows;
+}
+
+static void report(const char *name, long rows, size_t bytes, double secs) {
+    printf("  %-8s %10.1f ms %10.2f Mrows/s %9.1f MB/s\n",
+           name, secs * 1e3, rows / secs / 1e6, bytes / secs / 1e6);
+}
+
+int main(int argc, char **argv) {
+    long defaults[] = { 10000, 1000000, 10000000 };
+    int n = argc > 1 ? argc - 1 : 3;
+    const char *impls[] = { "scalar", "sse2", "avx2" };
+    struct string data;
+    init_string(&data);
+
+    for (int i = 0; i < n; i++) {
+        long rows = argc > 1 ? atol(argv[i + 1]) : defaults[i];
+        if (rows < 1) {
+            fprintf(stderr, "usage: %s [rows ...]\n", argv[0]);
+            return 1;
+        }
+        generate(&data, rows);
+        printf("%ld rows, %.1f MB\n", rows, data.len / 1e6);
+
+        long sum_ref = 0;
+        double t = now();
+        long got = run_sscanf(data.ptr, data.len, &sum_ref);
+        report("sscanf", got, data.len, now() - t);
+
+        for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+            if (csv_use_impl(impls[k]) != 0) {
+                printf("  %-8s not supported on this cpu\n", impls[k]);
+                continue;
+            }
+            long sum = 0;
+            t = now();
+            got = run_reader(data.ptr, data.len, &sum);
+            double secs = now() - t;
+            report(impls[k], got, data.len, secs);
+            if (got != rows || sum != sum_ref) {
+                fprintf(stderr, "%s: parsed %ld rows, checksum mismatch\n", impls[k], got);
+                return 1;
+            }
+        }
+    }
+    free(data.ptr);
+    return 0;
+}
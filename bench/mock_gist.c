@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#include "../accounts.h"
+#include "../gist.h"
+#include "../strbuf.h"
+#include "mock_gist.h"
+
+struct gist {
+    char *path;
+    struct string content;
+    unsigned long revision;
+    struct gist *next;
+};
+
+static struct {
+    struct mock_gist_config cfg;
+    pthread_mutex_t lock;
+    struct gist *gists;
+    struct mock_gist_stats stats;
+    // requests taken out of the quota in the window ending at window_end
+    long used;
+    time_t window_end;
+    int fd;
+} m = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+void mock_gist_row(long i, char *regno, size_t regno_len, int *pin, int *balance) {
+    snprintf(regno, regno_len, "R%07ld", i);
+    *pin = (int)(i % 10000);
+    *balance = (int)(1000 + i % 1000);
+}
+
+static size_t shard_of(const char *regno) {
+    // as gist_shard_of
+    return m.cfg.shards > 1 ? account_hash(regno) % m.cfg.shards : 0;
+}
+
+// called with the lock held. a path ending in a number is that shard
+static struct gist *find_gist(const char *path) {
+    for (struct gist *g = m.gists; g; g = g->next) {
+        if (strcmp(g->path, path) == 0)
+            return g;
+    }
+    struct gist *g = calloc(1, sizeof(*g));
+    if (!g || !(g->path = strdup(path))) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    init_string(&g->content);
+    const char *slash = strrchr(path, '/');
+    size_t shard = slash ? strtoul(slash + 1, NULL, 10) : 0;
+    for (long i = 0; i < m.cfg.accounts; i++) {
+        char regno[32];
+        int pin, balance;
+        mock_gist_row(i, regno, sizeof(regno), &pin, &balance);
+        if (shard_of(regno) != shard)
+            continue;
+        string_append_str(&g->content, regno);
+        string_append_str(&g->content, ",");
+        string_append_int(&g->content, pin);
+        string_append_str(&g->content, ",Name ");
+        string_append_int(&g->content, i);
+        string_append_str(&g->content, ",");
+        string_append_int(&g->content, balance);
+        string_append_str(&g->content, "\n");
+    }
+    g->revision = 1;
+    g->next = m.gists;
+    m.gists = g;
+    return g;
+}
+
+static void etag_of(const struct gist *g, char *out, size_t n) {
+    snprintf(out, n, "\"r%lu\"", g->revision);
+}
+
+// the value of header name in the request head, "" if it isn't there
+static void header(const char *head, const char *name, char *out, size_t n) {
+    size_t len = strlen(name);
+    out[0] = '\0';
+    for (const char *p = strstr(head, "\r\n"); p; p = strstr(p, "\r\n")) {
+        p += 2;
+        if (strncasecmp(p, name, len) != 0 || p[len] != ':')
+            continue;
+        p += len + 1;
+        while (*p == ' ')
+            p++;
+        size_t k = strcspn(p, "\r\n");
+        if (k >= n)
+            k = n - 1;
+        memcpy(out, p, k);
+        out[k] = '\0';
+        return;
+    }
+}
+
+// decodes the JSON string that starts at p (just past the quote)
+static int unescape(const char *p, const char *end, struct string *out) {
+    out->len = 0;
+    out->ptr[0] = '\0';
+    while (p < end && *p != '"') {
+        if (*p != '\\') {
+            const char *q = p;
+            while (q < end && *q != '"' && *q != '\\')
+                q++;
+            string_append(out, p, q - p);
+            p = q;
+            continue;
+        }
+        if (++p >= end)
+            return -1;
+        char c = *p++;
+        switch (c) {
+        case 'n': string_append(out, "\n", 1); break;
+        case 'r': string_append(out, "\r", 1); break;
+        case 't': string_append(out, "\t", 1); break;
+        case 'b': string_append(out, "\b", 1); break;
+        case 'f': string_append(out, "\f", 1); break;
+        case 'u': {
+            if (end - p < 4)
+                return -1;
+            char hex[5] = { p[0], p[1], p[2], p[3], 0 };
+            long v = strtol(hex, NULL, 16);
+            p += 4;
+            // the client only escapes control characters this way
+            char ch = (char)v;
+            string_append(out, &ch, 1);
+            break;
+        }
+        default: string_append(out, &c, 1); break;
+        }
+    }
+    return p < end ? 0 : -1;
+}
+
+// extra is more header lines, each ending in \r\n
+static void respond(int fd, struct string *out, int status, const char *reason,
+                    const char *etag, const char *extra, const char *body, size_t body_len) {
+    out->len = 0;
+    string_append_str(out, "HTTP/1.1 ");
+    string_append_int(out, status);
+    string_append_str(out, " ");
+    string_append_str(out, reason);
+    string_append_str(out, "\r\nContent-Type: application/json\r\nContent-Length: ");
+    string_append_int(out, (long)body_len);
+    if (etag) {
+        string_append_str(out, "\r\nETag: ");
+        string_append_str(out, etag);
+    }
+    string_append_str(out, "\r\n");
+    string_append_str(out, extra);
+    string_append_str(out, "\r\n");
+    string_append(out, body, body_len);
+
+    if (m.cfg.latency_ms > 0)
+        usleep(m.cfg.latency_ms * 1000);
+    size_t off = 0;
+    while (off < out->len) {
+        ssize_t n = send(fd, out->ptr + off, out->len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    pthread_mutex_lock(&m.lock);
+    m.stats.bytes_out += off;
+    pthread_mutex_unlock(&m.lock);
+}
+
+static void gist_document(struct string *doc, const struct gist *g) {
+    doc->len = 0;
+    string_append_str(doc, "{\"files\": {\"" FILE_NAME "\": {\"filename\": \"" FILE_NAME "\", \"content\": \"");
+    string_append_json(doc, g->content.ptr, g->content.len);
+    string_append_str(doc, "\"}");
+    if (m.cfg.other_file)
+        string_append_str(doc, ", \"notes.txt\": {\"filename\": \"notes.txt\", \"truncated\": true, "
+                               "\"raw_url\": \"http://127.0.0.1:1/notes.txt\", "
+                               "\"content\": \"R9999999,1,Stray,1000000\\n\"}");
+    string_append_str(doc, "}, \"description\": \"");
+    for (size_t i = 0; i < m.cfg.padding; i++)
+        string_append(doc, "x", 1);
+    string_append_str(doc, "\"}");
+}
+
+// gzips the document in place, like the api does for a client that
+// sends Accept-Encoding: gzip. returns -1 if it couldn't
+static int gzip_document(struct string *doc) {
+    z_stream zs = {0};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    uLong bound = deflateBound(&zs, doc->len);
+    unsigned char *gz = malloc(bound);
+    if (!gz) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = (Bytef *)doc->ptr;
+    zs.avail_in = doc->len;
+    zs.next_out = gz;
+    zs.avail_out = bound;
+    int rc = deflate(&zs, Z_FINISH);
+    size_t n = zs.total_out;
+    deflateEnd(&zs);
+    if (rc == Z_STREAM_END) {
+        doc->len = 0;
+        string_append(doc, (const char *)gz, n);
+    }
+    free(gz);
+    return rc == Z_STREAM_END ? 0 : -1;
+}
+
+static void handle(int fd, const char *head, const char *body, size_t body_len,
+                   struct string *doc, struct string *out) {
+    char method[8] = "", path[256] = "";
+    sscanf(head, "%7s %255s", method, path);
+    char etag[64], cond[GIST_ETAG_MAX], limit[256] = "";
+
+    pthread_mutex_lock(&m.lock);
+    m.stats.requests++;
+    if (m.cfg.quota > 0) {
+        time_t now = time(NULL);
+        if (now >= m.window_end) {
+            m.window_end = (now / m.cfg.window_s + 1) * m.cfg.window_s;
+            m.used = 0;
+        }
+        long left = m.used < m.cfg.quota ? m.cfg.quota - m.used - 1 : 0;
+        snprintf(limit, sizeof(limit), "X-RateLimit-Limit: %ld\r\nX-RateLimit-Remaining: %ld\r\n",
+                 m.cfg.quota, left);
+        if (!m.cfg.no_reset) {
+            size_t n = strlen(limit);
+            snprintf(limit + n, sizeof(limit) - n, "X-RateLimit-Reset: %ld\r\n", (long)m.window_end);
+        }
+        if (m.used >= m.cfg.quota) {
+            m.stats.throttled++;
+            if (m.cfg.limit_status == 429) {
+                size_t n = strlen(limit);
+                snprintf(limit + n, sizeof(limit) - n, "Retry-After: %ld\r\n",
+                         (long)(m.window_end - now));
+            }
+            pthread_mutex_unlock(&m.lock);
+            if (m.cfg.limit_status == 429)
+                respond(fd, out, 429, "Too Many Requests", NULL, limit, "{}", 2);
+            else
+                respond(fd, out, 403, "Forbidden", NULL, limit, "{}", 2);
+            return;
+        }
+        m.used++;
+    }
+    struct gist *g = find_gist(path);
+    etag_of(g, etag, sizeof(etag));
+
+    if (strcmp(method, "GET") == 0) {
+        m.stats.gets++;
+        header(head, "If-None-Match", cond, sizeof(cond));
+        if (strcmp(cond, etag) == 0) {
+            m.stats.not_modified++;
+            pthread_mutex_unlock(&m.lock);
+            respond(fd, out, 304, "Not Modified", etag, limit, "", 0);
+            return;
+        }
+        gist_document(doc, g);
+        pthread_mutex_unlock(&m.lock);
+        header(head, "Accept-Encoding", cond, sizeof(cond));
+        if (strstr(cond, "gzip") && gzip_document(doc) == 0) {
+            size_t n = strlen(limit);
+            snprintf(limit + n, sizeof(limit) - n, "Content-Encoding: gzip\r\n");
+        }
+        respond(fd, out, 200, "OK", etag, limit, doc->ptr, doc->len);
+        return;
+    }
+
+    if (strcmp(method, "PATCH") == 0) {
+        m.stats.patches++;
+        header(head, "If-Match", cond, sizeof(cond));
+        if (cond[0] && strcmp(cond, etag) != 0) {
+            m.stats.conflicts++;
+            pthread_mutex_unlock(&m.lock);
+            respond(fd, out, 412, "Precondition Failed", etag, limit, "{}", 2);
+            return;
+        }
+        const char *p = strstr(body, "\"content\": \"");
+        if (!p || unescape(p + 12, body + body_len, doc) != 0) {
+            pthread_mutex_unlock(&m.lock);
+            respond(fd, out, 400, "Bad Request", NULL, limit, "{}", 2);
+            return;
+        }
+        struct string t = g->content;
+        g->content = *doc;
+        *doc = t;
+        g->revision++;
+        etag_of(g, etag, sizeof(etag));
+        pthread_mutex_unlock(&m.lock);
+        respond(fd, out, 200, "OK", etag, limit, "{}", 2);
+        return;
+    }
+
+    pthread_mutex_unlock(&m.lock);
+    respond(fd, out, 405, "Method Not Allowed", NULL, limit, "{}", 2);
+}
+
+// one keep-alive connection, requests handled in order
+static void *serve(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    struct string in, doc, out;
+    init_string(&in);
+    init_string(&doc);
+    init_string(&out);
+    char buf[65536];
+    // whether the request being read was told to go ahead with its body
+    int continued = 0;
+    for (;;) {
+        char *end = strstr(in.ptr, "\r\n\r\n");
+        if (end) {
+            size_t head_len = end + 4 - in.ptr;
+            char cl[32], expect[32];
+            *end = '\0';
+            header(in.ptr, "Content-Length", cl, sizeof(cl));
+            header(in.ptr, "Expect", expect, sizeof(expect));
+            size_t body_len = strtoul(cl, NULL, 10);
+            if (in.len < head_len + body_len && !continued && strcasecmp(expect, "100-continue") == 0) {
+                // or curl holds the body back for a second
+                send(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_NOSIGNAL);
+                continued = 1;
+            }
+            if (in.len >= head_len + body_len) {
+                continued = 0;
+                char saved = in.ptr[head_len + body_len];
+                in.ptr[head_len + body_len] = '\0';
+                handle(fd, in.ptr, in.ptr + head_len, body_len, &doc, &out);
+                in.ptr[head_len + body_len] = saved;
+                size_t used = head_len + body_len;
+                memmove(in.ptr, in.ptr + used, in.len - used + 1);
+                in.len -= used;
+                continue;
+            }
+            *end = '\r';
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        pthread_mutex_lock(&m.lock);
+        m.stats.bytes_in += n;
+        pthread_mutex_unlock(&m.lock);
+        string_append(&in, buf, n);
+    }
+    close(fd);
+    free(in.ptr);
+    free(doc.ptr);
+    free(out.ptr);
+    return NULL;
+}
+
+static void *accept_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        int fd = accept(m.fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        pthread_t t;
+        if (pthread_create(&t, NULL, serve, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(t);
+    }
+    return NULL;
+}
+
+int mock_gist_start(const struct mock_gist_config *cfg) {
+    m.cfg = *cfg;
+    if (m.cfg.shards < 1)
+        m.cfg.shards = 1;
+    if (m.cfg.window_s < 1)
+        m.cfg.window_s = 1;
+    m.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    if (m.fd < 0 || bind(m.fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(m.fd, 1024) != 0 || getsockname(m.fd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("mock gist");
+        return -1;
+    }
+    pthread_t t;
+    if (pthread_create(&t, NULL, accept_main, NULL) != 0)
+        return -1;
+    pthread_detach(t);
+    return ntohs(addr.sin_port);
+}
+
+void mock_gist_get_stats(struct mock_gist_stats *out) {
+    pthread_mutex_lock(&m.lock);
+    *out = m.stats;
+    pthread_mutex_unlock(&m.lock);
+}
+
+long long mock_gist_total_balance(void) {
+    long long total = 0;
+    pthread_mutex_lock(&m.lock);
+    // shards nobody asked for yet still hold their seed rows
+    for (size_t k = 0; k < m.cfg.shards; k++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/gists/%zu", k);
+        find_gist(path);
+    }
+    // csv or compact, whichever the client wrote
+    struct account_table t = {0};
+    for (struct gist *g = m.gists; g; g = g->next) {
+        account_table_load(&t, g->content.ptr);
+        for (size_t i = 0; i < t.count; i++)
+            total += t.rows[i].balance;
+    }
+    account_table_free(&t);
+    pthread_mutex_unlock(&m.lock);
+    return total;
+}
@@ -0,0 +1,65 @@
+#ifndef MOCK_GIST_H
+#define MOCK_GIST_H
+
+#include <stddef.h>
+
+// in-process stand-in for the gists api, for the benchmarks. every path
+// is a gist of its own holding one FILE_NAME, /gists/<k> being shard k:
+//
+//   GET    answers with the gist document, gzipped if the client can
+//          take that, or 304 when If-None-Match names the current ETag
+//   PATCH  replaces the content, or answers 412 when If-Match names an
+//          older revision
+//
+// with a quota every reply carries X-RateLimit-Remaining/-Reset like the
+// api's, and requests over it are turned away with limit_status until
+// the window resets
+//
+// each connection gets a thread, so a slow reply holds up nobody else
+
+struct mock_gist_config {
+    // added to every reply
+    int latency_ms;
+    // rows every gist starts out with, R0000000 ... of mock_gist_row.
+    // rows whose regno doesn't hash to a path's shard are left out of it
+    // when shards > 1, like the client would store them
+    long accounts;
+    size_t shards;
+    // bytes of metadata around the content, like the real api sends
+    size_t padding;
+    // another file after FILE_NAME, cut off and with a row of its own,
+    // that the client has to leave alone
+    int other_file;
+    // requests allowed per window_s seconds, 0 for no limit
+    long quota;
+    int window_s;
+    // 403 like the api's primary limit, or 429 with Retry-After
+    int limit_status;
+    // leave X-RateLimit-Reset out, so the client can't tell when the
+    // quota comes back
+    int no_reset;
+};
+
+struct mock_gist_stats {
+    unsigned long requests;
+    unsigned long gets;
+    unsigned long not_modified;
+    unsigned long patches;
+    unsigned long conflicts;
+    // requests over the quota
+    unsigned long throttled;
+    // request and reply bytes, headers included
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+};
+
+// starts serving on 127.0.0.1 and returns the port, -1 on failure
+int mock_gist_start(const struct mock_gist_config *cfg);
+void mock_gist_get_stats(struct mock_gist_stats *out);
+// sum of the balances over every shard, for lost update checks
+long long mock_gist_total_balance(void);
+
+// the seed row i, as written to the csv
+void mock_gist_row(long i, char *regno, size_t regno_len, int *pin, int *balance);
+
+#endif
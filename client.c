@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "client.h"
+#include "proto.h"
+
+static int sock = -1;
+// a PROTO_FLUSH whose reply hasn't been read. it comes back ahead of
+// the reply to anything sent after it
+static int flush_pending;
+
+int client_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(path);
+        client_close();
+        return -1;
+    }
+    return 0;
+}
+
+void client_close(void) {
+    if (sock >= 0)
+        close(sock);
+    sock = -1;
+    flush_pending = 0;
+}
+
+static int send_msg(const struct proto_msg *m) {
+    const char *p = (const char *)m;
+    size_t left = sizeof(*m);
+    while (left) {
+        ssize_t n = send(sock, p, left, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        left -= n;
+    }
+    return 0;
+}
+
+static int recv_msg(struct proto_msg *m) {
+    char *p = (char *)m;
+    size_t left = sizeof(*m);
+    while (left) {
+        ssize_t n = recv(sock, p, left, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        left -= n;
+    }
+    return 0;
+}
+
+static int call(struct proto_msg *m) {
+    struct proto_msg flushed;
+    if (sock >= 0 && flush_pending && recv_msg(&flushed) == 0)
+        flush_pending = 0;
+    if (sock < 0 || flush_pending || send_msg(m) != 0 || recv_msg(m) != 0) {
+        fprintf(stderr, "Lost connection to atmd\n");
+        client_close();
+        return -1;
+    }
+    return m->status;
+}
+
+static void request(struct proto_msg *m, int op, const char *regno) {
+    memset(m, 0, sizeof(*m));
+    m->op = op;
+    snprintf(m->regno, sizeof(m->regno), "%s", regno);
+}
+
+int client_login(const char *regno, int pin, struct account *out) {
+    struct proto_msg m;
+    request(&m, PROTO_LOGIN, regno);
+    m.pin = pin;
+    int rc = call(&m);
+    if (rc == PROTO_OK) {
+        memcpy(out->regno, m.regno, sizeof(out->regno));
+        memcpy(out->name, m.name, sizeof(out->name));
+        out->regno[REGNO_LEN - 1] = out->name[NAME_LEN - 1] = '\0';
+        out->pin = m.pin;
+        out->balance = m.value;
+    }
+    return rc;
+}
+
+int client_add_balance(const char *regno, int delta, int *balance) {
+    struct proto_msg m;
+    request(&m, PROTO_BALANCE, regno);
+    m.value = delta;
+    int rc = call(&m);
+    if (rc == PROTO_OK || rc == PROTO_INSUFFICIENT)
+        *balance = m.value;
+    return rc;
+}
+
+int client_set_name(const char *regno, const char *name) {
+    struct proto_msg m;
+    request(&m, PROTO_SET_NAME, regno);
+    snprintf(m.name, sizeof(m.name), "%s", name);
+    return call(&m);
+}
+
+int client_set_pin(const char *regno, int pin) {
+    struct proto_msg m;
+    request(&m, PROTO_SET_PIN, regno);
+    m.pin = pin;
+    return call(&m);
+}
+
+int client_flush_start(void) {
+    struct proto_msg m;
+    request(&m, PROTO_FLUSH, "");
+    if (sock < 0 || flush_pending || send_msg(&m) != 0)
+        return -1;
+    flush_pending = 1;
+    return 0;
+}
+
+int client_flush_wait(int timeout_ms) {
+    if (sock < 0 || !flush_pending)
+        return -1;
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return 0;
+    struct proto_msg m;
+    if (recv_msg(&m) != 0) {
+        client_close();
+        return -1;
+    }
+    flush_pending = 0;
+    return m.status == PROTO_OK ? 1 : -1;
+}
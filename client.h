@@ -0,0 +1,28 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "accounts.h"
+
+// atm's end of the atmd protocol (proto.h). every call is one round trip
+// over the unix socket and returns a proto_status, or -1 if the daemon
+// can't be reached. the daemon keeps the table in memory, so only the
+// flush ever waits on the network
+
+int client_connect(const char *path);
+void client_close(void);
+
+// on success out holds the row as the daemon has it
+int client_login(const char *regno, int pin, struct account *out);
+// balance is set to the row's balance after the call, also when the
+// withdrawal was refused
+int client_add_balance(const char *regno, int delta, int *balance);
+int client_set_name(const char *regno, const char *name);
+int client_set_pin(const char *regno, int pin);
+
+// asks for everything changed so far to be written to the gist. wait
+// returns 1 once it has been, -1 on failure and 0 if it is still going
+// after timeout_ms
+int client_flush_start(void);
+int client_flush_wait(int timeout_ms);
+
+#endif
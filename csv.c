@@ -0,0 +1,200 @@
+#include <string.h>
+#include <limits.h>
+
+#include "csv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSV_X86 1
+#endif
+
+#define CSV_BLOCK 64
+
+// bit i set when p[i] is ',' or '\n'
+typedef uint64_t (*block_fn)(const char *p);
+
+static uint64_t block_scalar(const char *p) {
+    uint64_t m = 0;
+    for (int i = 0; i < CSV_BLOCK; i++) {
+        if (p[i] == ',' || p[i] == '\n')
+            m |= 1ULL << i;
+    }
+    return m;
+}
+
+#ifdef CSV_X86
+__attribute__((target("sse2")))
+static uint64_t block_sse2(const char *p) {
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t m = 0;
+    for (int i = 0; i < CSV_BLOCK / 16; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, nl));
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(hit) << (16 * i);
+    }
+    return m;
+}
+
+__attribute__((target("avx2")))
+static uint64_t block_avx2(const char *p) {
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    __m256i hit_lo = _mm256_or_si256(_mm256_cmpeq_epi8(lo, comma), _mm256_cmpeq_epi8(lo, nl));
+    __m256i hit_hi = _mm256_or_si256(_mm256_cmpeq_epi8(hi, comma), _mm256_cmpeq_epi8(hi, nl));
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(hit_lo) |
+           (uint64_t)(uint32_t)_mm256_movemask_epi8(hit_hi) << 32;
+}
+#endif
+
+static block_fn block_mask;
+static const char *impl_name;
+
+static void pick_impl(void) {
+#ifdef CSV_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        block_mask = block_avx2;
+        impl_name = "avx2";
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        block_mask = block_sse2;
+        impl_name = "sse2";
+        return;
+    }
+#endif
+    block_mask = block_scalar;
+    impl_name = "scalar";
+}
+
+int csv_use_impl(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        block_mask = block_scalar;
+        impl_name = "scalar";
+        return 0;
+    }
+#ifdef CSV_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        block_mask = block_sse2;
+        impl_name = "sse2";
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        block_mask = block_avx2;
+        impl_name = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+const char *csv_impl_name(void) {
+    if (!block_mask)
+        pick_impl();
+    return impl_name;
+}
+
+// the last partial block is done byte by byte so we never read past end
+static uint64_t load_block(const char *p, const char *end) {
+    if (end - p >= CSV_BLOCK)
+        return block_mask(p);
+    uint64_t m = 0;
+    for (int i = 0; p + i < end; i++) {
+        if (p[i] == ',' || p[i] == '\n')
+            m |= 1ULL << i;
+    }
+    return m;
+}
+
+void csv_reader_init(struct csv_reader *r, const char *buf, size_t len) {
+    if (!block_mask)
+        pick_impl();
+    r->end = buf + len;
+    r->block = buf;
+    r->line = buf;
+    r->lineno = 0;
+    r->mask = load_block(buf, r->end);
+}
+
+// next ',' or '\n', or end when there are none left
+static const char *next_delim(struct csv_reader *r) {
+    while (!r->mask) {
+        if (r->end - r->block <= CSV_BLOCK)
+            return r->end;
+        r->block += CSV_BLOCK;
+        r->mask = load_block(r->block, r->end);
+    }
+    const char *d = r->block + __builtin_ctzll(r->mask);
+    r->mask &= r->mask - 1;
+    return d;
+}
+
+int csv_parse_int(const char *p, size_t n, int *out) {
+    const char *end = p + n;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    if (p == end || end - p > 10)
+        return -1;
+
+    long long v = 0;
+    for (; p < end; p++) {
+        unsigned d = (unsigned char)*p - '0';
+        if (d > 9)
+            return -1;
+        v = v * 10 + d;
+    }
+    if (neg)
+        v = -v;
+    if (v < INT_MIN || v > INT_MAX)
+        return -1;
+    *out = (int)v;
+    return 0;
+}
+
+int csv_read(struct csv_reader *r, struct csv_record *rec) {
+    while (r->line < r->end) {
+        const char *line = r->line;
+        // up to four commas: the fourth ends the balance like %d would
+        const char *comma[4];
+        int n = 0;
+        const char *p;
+        for (;;) {
+            p = next_delim(r);
+            if (p == r->end || *p == '\n')
+                break;
+            if (n < 4)
+                comma[n++] = p;
+        }
+        r->line = p < r->end ? p + 1 : r->end;
+        r->lineno++;
+
+        rec->line.ptr = line;
+        rec->line.len = p - line;
+        if (rec->line.len && line[rec->line.len - 1] == '\r')
+            rec->line.len--;
+        if (rec->line.len == 0)
+            continue;
+        const char *eol = n == 4 ? comma[3] : p;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        if (n < 3 || comma[0] == line || comma[2] == comma[1] + 1)
+            return -1;
+
+        rec->regno.ptr = line;
+        rec->regno.len = comma[0] - line;
+        rec->name.ptr = comma[1] + 1;
+        rec->name.len = comma[2] - comma[1] - 1;
+        if (csv_parse_int(comma[0] + 1, comma[1] - comma[0] - 1, &rec->pin) != 0 ||
+            csv_parse_int(comma[2] + 1, eol - comma[2] - 1, &rec->balance) != 0)
+            return -1;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// parser for the regno,pin,name,balance lines of nfc_data.csv. nothing
+// is copied: fields are views into the buffer being parsed. delimiters
+// are located 64 bytes at a time with AVX2 or SSE2 where available
+
+struct csv_field {
+    const char *ptr;
+    size_t len;
+};
+
+struct csv_record {
+    // the whole line without its line break
+    struct csv_field line;
+    struct csv_field regno;
+    int pin;
+    struct csv_field name;
+    int balance;
+};
+
+struct csv_reader {
+    const char *end;
+    // start of the 64 byte block described by mask
+    const char *block;
+    // one bit per ',' or '\n' in the block not consumed yet
+    uint64_t mask;
+    // where the next line starts
+    const char *line;
+    // 1-based number of the line csv_read last returned
+    unsigned long lineno;
+};
+
+void csv_reader_init(struct csv_reader *r, const char *buf, size_t len);
+// fills rec with the next line. returns 1, or 0 at the end of the
+// buffer. a line that isn't regno,pin,name,balance returns -1 with only
+// rec->line set, r->lineno says which one it was. empty lines are
+// skipped
+int csv_read(struct csv_reader *r, struct csv_record *rec);
+
+// parses a decimal int without locale or errno overhead. leading blanks
+// and a sign are accepted like %d. returns 0 on success
+int csv_parse_int(const char *p, size_t n, int *out);
+
+// forces a delimiter search implementation: "avx2", "sse2" or "scalar".
+// returns -1 if it isn't available on this cpu. for benchmarking
+int csv_use_impl(const char *name);
+const char *csv_impl_name(void);
+
+#endif
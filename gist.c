@@ -0,0 +1,1206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "accounts.h"
+#include "gist.h"
+#include "metrics.h"
+
+static CURLSH *share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+// built once, read only afterwards so every handle can point at them
+static struct curl_slist *get_headers;
+static struct curl_slist *patch_headers;
+
+static struct gist_conn default_conn;
+static const char *api_url = API_URL;
+// one url per shard, from ATM_SHARD_URLS. a single shard at api_url
+// without it
+static char **shard_urls;
+static size_t shard_count;
+
+// retries of a failed request: the first waits about RETRY_BASE_MS, each
+// one after that twice as long, up to RETRY_CAP_MS, with a random part
+// so clients that failed together don't come back together
+#define RETRY_BASE_MS 250
+#define RETRY_CAP_MS 8000
+#define RETRY_MAX_DEFAULT 4
+// a rate limit that lifts sooner than this is waited out, a longer one
+// fails the request straight away
+#define RATE_WAIT_MAX_MS 10000
+#define RATE_RESERVE_DEFAULT 20
+// how long a remaining count that came without a reset time is believed
+#define RATE_UNTIMED_MS 2000
+
+// the quota as the last reply saw it, shared by every connection since
+// they all spend the same token's
+static struct {
+    pthread_mutex_t lock;
+    // requests left before reset_ms (epoch milliseconds), -1 if unknown
+    long remaining;
+    long long reset_ms;
+    // nothing is sent before this, after a 403/429
+    long long blocked_until_ms;
+    int retry_max;
+    long reserve;
+    struct gist_rate_stats stats;
+} rate = { .lock = PTHREAD_MUTEX_INITIALIZER, .remaining = -1 };
+
+// gist_fetch calls waiting on the same gist share one request
+struct flight {
+    const char *url;
+    struct gist_conn *leader;
+    int waiters;
+    int done;
+    // the leader's result, copied for the waiters
+    char *content;
+    char etag[GIST_ETAG_MAX];
+    struct flight *next;
+};
+
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flights_cond = PTHREAD_COND_INITIALIZER;
+static struct flight *flights;
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void)handle;
+    (void)access;
+    (void)userptr;
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    (void)handle;
+    (void)userptr;
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+// splits ATM_SHARD_URLS at commas
+static int init_shards(void) {
+    const char *list = getenv("ATM_SHARD_URLS");
+    shard_count = 1;
+    if (list && *list) {
+        for (const char *p = list; (p = strchr(p, ',')); p++)
+            shard_count++;
+    }
+    shard_urls = calloc(shard_count, sizeof(*shard_urls));
+    if (!shard_urls) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    if (!list || !*list) {
+        shard_urls[0] = strdup(api_url);
+        return shard_urls[0] ? 0 : -1;
+    }
+    const char *p = list;
+    for (size_t i = 0; i < shard_count; i++) {
+        const char *end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n == 0) {
+            fprintf(stderr, "Empty shard url in ATM_SHARD_URLS\n");
+            return -1;
+        }
+        if (!(shard_urls[i] = strndup(p, n)))
+            return -1;
+        p += n + 1;
+    }
+    return 0;
+}
+
+int gist_global_init(void) {
+    const char *url = getenv("ATM_API_URL");
+    if (url && *url)
+        api_url = url;
+    const char *v = getenv("ATM_RETRY_MAX");
+    rate.retry_max = v && *v ? atoi(v) : RETRY_MAX_DEFAULT;
+    v = getenv("ATM_RATE_RESERVE");
+    rate.reserve = v && *v ? atol(v) : RATE_RESERVE_DEFAULT;
+    rate.remaining = -1;
+    rate.reset_ms = rate.blocked_until_ms = 0;
+    if (init_shards() != 0)
+        return -1;
+
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        fprintf(stderr, "Failed to initialize CURL\n");
+        return -1;
+    }
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&share_locks[i], NULL);
+
+    share = curl_share_init();
+    if (!share) {
+        fprintf(stderr, "Failed to initialize CURL share\n");
+        return -1;
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    get_headers = curl_slist_append(get_headers, "Authorization: token " GITHUB_TOKEN);
+    get_headers = curl_slist_append(get_headers, "User-Agent: ATM-Simulator");
+
+    patch_headers = curl_slist_append(patch_headers, "Authorization: token " GITHUB_TOKEN);
+    patch_headers = curl_slist_append(patch_headers, "User-Agent: ATM-Simulator");
+    patch_headers = curl_slist_append(patch_headers, "Content-Type: application/json");
+
+    if (!get_headers || !patch_headers) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    return gist_conn_init(&default_conn);
+}
+
+void gist_global_cleanup(void) {
+    gist_conn_cleanup(&default_conn);
+    if (share) {
+        curl_share_cleanup(share);
+        share = NULL;
+    }
+    curl_slist_free_all(get_headers);
+    curl_slist_free_all(patch_headers);
+    get_headers = patch_headers = NULL;
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_destroy(&share_locks[i]);
+    for (size_t i = 0; i < shard_count; i++)
+        free(shard_urls[i]);
+    free(shard_urls);
+    shard_urls = NULL;
+    shard_count = 0;
+    curl_global_cleanup();
+}
+
+size_t gist_shard_count(void) {
+    return shard_count;
+}
+
+size_t gist_shard_of(const char *regno) {
+    // the same hash the account index uses
+    return shard_count > 1 ? account_hash(regno) % shard_count : 0;
+}
+
+void gist_conn_set_shard(struct gist_conn *c, size_t shard) {
+    c->url = shard_urls[shard];
+    curl_easy_setopt(c->curl, CURLOPT_URL, c->url);
+}
+
+void gist_conn_use_multi(struct gist_conn *c, CURLM *multi) {
+    if (c->multi && !c->multi_shared) {
+        curl_multi_remove_handle(c->multi, c->curl);
+        curl_multi_cleanup(c->multi);
+    }
+    c->multi = multi;
+    c->multi_shared = 1;
+}
+
+int gist_conn_init(struct gist_conn *c) {
+    memset(c, 0, sizeof(*c));
+    c->curl = curl_easy_init();
+    if (!c->curl) {
+        fprintf(stderr, "Failed to initialize CURL\n");
+        return -1;
+    }
+
+    c->url = shard_urls ? shard_urls[0] : api_url;
+    curl_easy_setopt(c->curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(c->curl, CURLOPT_URL, c->url);
+    // lets a multi handle shared by several connections tell them apart
+    curl_easy_setopt(c->curl, CURLOPT_PRIVATE, c);
+    curl_easy_setopt(c->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(c->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(c->curl, CURLOPT_TCP_KEEPIDLE, 30L);
+    curl_easy_setopt(c->curl, CURLOPT_TCP_KEEPINTVL, 15L);
+    curl_easy_setopt(c->curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+    // Accept-Encoding with whatever libcurl can decode (gzip at least),
+    // replies are inflated before fetch_write sees them
+    curl_easy_setopt(c->curl, CURLOPT_ACCEPT_ENCODING, "");
+
+    init_string(&c->body);
+    init_string(&c->spare);
+    init_string(&c->payload);
+    return 0;
+}
+
+void gist_conn_cleanup(struct gist_conn *c) {
+    if (c->multi) {
+        curl_multi_remove_handle(c->multi, c->curl);
+        if (!c->multi_shared)
+            curl_multi_cleanup(c->multi);
+        c->multi = NULL;
+    }
+    if (c->curl) {
+        curl_easy_cleanup(c->curl);
+        c->curl = NULL;
+    }
+    curl_slist_free_all(c->cond_headers);
+    curl_slist_free_all(c->match_headers);
+    free(c->etag);
+    free(c->body.ptr);
+    free(c->spare.ptr);
+    free(c->payload.ptr);
+    free(c->fetch);
+    c->fetch = NULL;
+    c->cond_headers = c->match_headers = NULL;
+    c->etag = c->content = NULL;
+    c->body.ptr = c->spare.ptr = c->payload.ptr = NULL;
+}
+
+// what we want from the headers of a reply
+struct reply_meta {
+    char etag[GIST_ETAG_MAX];
+    // X-RateLimit-Remaining and -Reset (epoch seconds), -1 / 0 if the
+    // reply had none. Retry-After in seconds, -1 if absent (the date
+    // form isn't something the api sends)
+    long remaining;
+    long reset;
+    long retry_after;
+};
+
+static void reply_meta_clear(struct reply_meta *m) {
+    m->etag[0] = '\0';
+    m->remaining = -1;
+    m->reset = 0;
+    m->retry_after = -1;
+}
+
+static long header_long(const char *v, size_t n) {
+    char buf[32];
+    if (n == 0 || n >= sizeof(buf))
+        return -1;
+    memcpy(buf, v, n);
+    buf[n] = '\0';
+    char *end;
+    long x = strtol(buf, &end, 10);
+    return *end || x < 0 ? -1 : x;
+}
+
+static size_t header_meta(char *buffer, size_t size, size_t nitems, void *userdata) {
+    size_t len = size * nitems;
+    struct reply_meta *m = userdata;
+    // a 100 Continue ahead of the real reply has headers of its own
+    if (len > 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+        reply_meta_clear(m);
+        return len;
+    }
+    const char *colon = memchr(buffer, ':', len);
+    if (!colon)
+        return len;
+    size_t name_len = colon - buffer;
+    const char *v = colon + 1;
+    const char *end = buffer + len;
+    while (v < end && isspace((unsigned char)*v)) v++;
+    while (end > v && isspace((unsigned char)end[-1])) end--;
+    size_t n = end - v;
+
+    if (name_len == 4 && strncasecmp(buffer, "etag", 4) == 0) {
+        if (n >= GIST_ETAG_MAX)
+            n = 0; // not something we could send back anyway
+        memcpy(m->etag, v, n);
+        m->etag[n] = '\0';
+    } else if (name_len == 21 && strncasecmp(buffer, "x-ratelimit-remaining", 21) == 0) {
+        m->remaining = header_long(v, n);
+    } else if (name_len == 17 && strncasecmp(buffer, "x-ratelimit-reset", 17) == 0) {
+        long reset = header_long(v, n);
+        m->reset = reset > 0 ? reset : 0;
+    } else if (name_len == 11 && strncasecmp(buffer, "retry-after", 11) == 0) {
+        m->retry_after = header_long(v, n);
+    }
+    return len;
+}
+
+static long long wall_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return (long long)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec t = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    while (nanosleep(&t, &t) != 0)
+        ;
+}
+
+// how long a request has to hold off before it may be sent, 0 if it may
+// go now (and is counted against the quota). once only the reserve is
+// left reads wait for the next window, that is kept for writes
+static long rate_admit(int write) {
+    long long now = wall_ms();
+    long wait = 0;
+    pthread_mutex_lock(&rate.lock);
+    if (rate.reset_ms && now >= rate.reset_ms) {
+        // a new window, the next reply says how much of it there is
+        rate.remaining = -1;
+        rate.reset_ms = 0;
+    }
+    if (rate.blocked_until_ms > now)
+        wait = (long)(rate.blocked_until_ms - now);
+    else if (rate.remaining == 0 && rate.reset_ms)
+        wait = (long)(rate.reset_ms - now);
+    else if (!write && rate.remaining >= 0 && rate.remaining <= rate.reserve) {
+        wait = rate.reset_ms ? (long)(rate.reset_ms - now) : RETRY_BASE_MS;
+        rate.stats.deferred++;
+    }
+    if (wait == 0) {
+        rate.stats.requests++;
+        // until the reply says otherwise, so parallel requests don't all
+        // count on the same last one
+        if (rate.remaining > 0)
+            rate.remaining--;
+    }
+    pthread_mutex_unlock(&rate.lock);
+    return wait;
+}
+
+// waits out a short rate limit. returns 0 once the request may go, else
+// how long it would have had to wait
+static long rate_wait(int write) {
+    long wait;
+    while ((wait = rate_admit(write)) > 0 && wait <= RATE_WAIT_MAX_MS)
+        sleep_ms(wait);
+    return wait;
+}
+
+// takes in the quota a reply reports. returns 1 if the server turned the
+// request away for going over a limit: a 429, or a 403 that says so
+static int rate_note(const struct reply_meta *m, long status) {
+    long long now = wall_ms();
+    int limited = status == 429 || (status == 403 && (m->remaining == 0 || m->retry_after >= 0));
+    pthread_mutex_lock(&rate.lock);
+    if (m->remaining >= 0) {
+        // without a reset time nothing would ever renew the count, and
+        // reads held back by the reserve would wait for good
+        rate.remaining = m->remaining;
+        rate.reset_ms = m->reset ? m->reset * 1000LL : now + RATE_UNTIMED_MS;
+    }
+    if (limited) {
+        rate.stats.throttled++;
+        long long until = now + RETRY_BASE_MS;
+        if (m->retry_after >= 0)
+            until = now + m->retry_after * 1000LL;
+        else if (rate.reset_ms > now)
+            until = rate.reset_ms;
+        if (until > rate.blocked_until_ms)
+            rate.blocked_until_ms = until;
+    }
+    pthread_mutex_unlock(&rate.lock);
+    return limited;
+}
+
+long gist_retry_delay_ms(int attempt) {
+    static __thread unsigned seed;
+    if (!seed)
+        seed = (unsigned)wall_ms() ^ (unsigned)(uintptr_t)&seed;
+    long delay = RETRY_CAP_MS;
+    if (attempt < 16 && (RETRY_BASE_MS << attempt) < RETRY_CAP_MS)
+        delay = RETRY_BASE_MS << attempt;
+    // somewhere between half and all of it
+    delay = delay / 2 + rand_r(&seed) % (delay / 2 + 1);
+
+    long long now = wall_ms();
+    pthread_mutex_lock(&rate.lock);
+    if (rate.blocked_until_ms - now > delay)
+        delay = (long)(rate.blocked_until_ms - now);
+    pthread_mutex_unlock(&rate.lock);
+    return delay;
+}
+
+static void count_retry(void) {
+    pthread_mutex_lock(&rate.lock);
+    rate.stats.retries++;
+    pthread_mutex_unlock(&rate.lock);
+}
+
+void gist_get_rate_stats(struct gist_rate_stats *out) {
+    pthread_mutex_lock(&rate.lock);
+    *out = rate.stats;
+    out->remaining = rate.remaining;
+    pthread_mutex_unlock(&rate.lock);
+}
+
+// remember a fresh 200 reply and rebuild the conditional header lists
+static void remember_snapshot(struct gist_conn *c, const char *etag) {
+    // the freshly decoded buffer becomes current, the old one is kept
+    // around as the target of the next fetch
+    struct string t = c->body;
+    c->body = c->spare;
+    c->spare = t;
+    c->content = c->body.ptr;
+    c->generation++;
+    if (c->on_content)
+        c->on_content(c->content, c->on_content_arg);
+
+    if (c->etag && strcmp(c->etag, etag) == 0)
+        return;
+    free(c->etag);
+    c->etag = NULL;
+    curl_slist_free_all(c->cond_headers);
+    curl_slist_free_all(c->match_headers);
+    c->cond_headers = c->match_headers = NULL;
+    if (!*etag)
+        return;
+    c->etag = strdup(etag);
+
+    char header[GIST_ETAG_MAX + 32];
+    snprintf(header, sizeof(header), "If-None-Match: %s", c->etag);
+    c->cond_headers = curl_slist_append(c->cond_headers, "Authorization: token " GITHUB_TOKEN);
+    c->cond_headers = curl_slist_append(c->cond_headers, "User-Agent: ATM-Simulator");
+    c->cond_headers = curl_slist_append(c->cond_headers, header);
+
+    snprintf(header, sizeof(header), "If-Match: %s", c->etag);
+    c->match_headers = curl_slist_append(c->match_headers, "Authorization: token " GITHUB_TOKEN);
+    c->match_headers = curl_slist_append(c->match_headers, "User-Agent: ATM-Simulator");
+    c->match_headers = curl_slist_append(c->match_headers, "Content-Type: application/json");
+    c->match_headers = curl_slist_append(c->match_headers, header);
+}
+
+// streaming extractor for files.FILE_NAME.content. it only tracks
+// nesting and object keys, decodes the one string we want straight into
+// the output buffer and steps over everything else. unlike a tokener it
+// builds no tree, so a fetch allocates nothing but that buffer however
+// the body is chunked. the file's truncated and raw_url are noted too:
+// github inlines only the first megabyte of a file
+#define SCAN_MAX_DEPTH 32
+#define SCAN_URL_MAX 512
+
+static const char *const content_path[] = { "files", FILE_NAME, "content" };
+
+enum scan_state { SCAN_VALUE, SCAN_STRING, SCAN_ESCAPE, SCAN_UNICODE };
+
+// the member of files.FILE_NAME the last key read names
+enum scan_field { FIELD_NONE, FIELD_RAW_URL, FIELD_TRUNCATED };
+
+struct content_scan {
+    enum scan_state state;
+    char stack[SCAN_MAX_DEPTH];
+    int depth;
+    // how many content_path components the open containers match
+    int matched;
+    // the last key read matched the next component
+    int key_matched;
+    enum scan_field field;
+    int expect_key;
+    int in_key;
+    int capture;
+    int in_url;
+    char key[64];
+    size_t key_len;
+    unsigned ucs;
+    int ucs_digits;
+    unsigned high_surrogate;
+    struct string *out;
+    int found;
+    int truncated;
+    char raw_url[SCAN_URL_MAX];
+    size_t raw_url_len;
+};
+
+static void scan_emit(struct content_scan *sc, const char *p, size_t n) {
+    if (sc->capture) {
+        string_append(sc->out, p, n);
+    } else if (sc->in_url) {
+        size_t room = sizeof(sc->raw_url) - 1 - sc->raw_url_len;
+        if (n > room) {
+            // longer than any url github hands out, don't use it
+            n = room;
+            sc->raw_url[0] = '\0';
+        }
+        memcpy(sc->raw_url + sc->raw_url_len, p, n);
+        sc->raw_url_len += n;
+        sc->raw_url[sc->raw_url_len] = '\0';
+    } else if (sc->in_key) {
+        size_t room = sizeof(sc->key) - 1 - sc->key_len;
+        if (n > room) {
+            // longer than any key we look for, make sure it can't match
+            n = room;
+            sc->key[0] = '\0';
+        }
+        memcpy(sc->key + sc->key_len, p, n);
+        sc->key_len += n;
+    }
+}
+
+static void scan_emit_utf8(struct content_scan *sc, unsigned cp) {
+    char u[4];
+    size_t n;
+    if (cp < 0x80) {
+        u[0] = cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        u[0] = 0xc0 | (cp >> 6);
+        u[1] = 0x80 | (cp & 0x3f);
+        n = 2;
+    } else if (cp < 0x10000) {
+        u[0] = 0xe0 | (cp >> 12);
+        u[1] = 0x80 | ((cp >> 6) & 0x3f);
+        u[2] = 0x80 | (cp & 0x3f);
+        n = 3;
+    } else {
+        u[0] = 0xf0 | (cp >> 18);
+        u[1] = 0x80 | ((cp >> 12) & 0x3f);
+        u[2] = 0x80 | ((cp >> 6) & 0x3f);
+        u[3] = 0x80 | (cp & 0x3f);
+        n = 4;
+    }
+    scan_emit(sc, u, n);
+}
+
+static void scan_end_string(struct content_scan *sc) {
+    if (sc->in_key) {
+        sc->key[sc->key_len] = '\0';
+        sc->key_matched = sc->depth >= 1 && sc->depth <= 3 &&
+                          sc->matched == sc->depth - 1 &&
+                          strcmp(sc->key, content_path[sc->depth - 1]) == 0;
+        sc->field = FIELD_NONE;
+        if (sc->depth == 3 && sc->matched == 2) {
+            if (strcmp(sc->key, "raw_url") == 0)
+                sc->field = FIELD_RAW_URL;
+            else if (strcmp(sc->key, "truncated") == 0)
+                sc->field = FIELD_TRUNCATED;
+        }
+    } else if (sc->capture) {
+        sc->found = 1;
+    }
+    sc->in_key = sc->capture = sc->in_url = 0;
+    sc->state = SCAN_VALUE;
+}
+
+// returns -1 on input that can't be a gist document
+static int content_scan_feed(struct content_scan *sc, const char *p, size_t len) {
+    const char *end = p + len;
+    while (p < end) {
+        char ch = *p;
+        switch (sc->state) {
+        case SCAN_VALUE:
+            p++;
+            switch (ch) {
+            case '"':
+                sc->in_key = sc->depth > 0 && sc->stack[sc->depth - 1] == '{' && sc->expect_key;
+                sc->capture = !sc->in_key && sc->key_matched && sc->depth == 3 && sc->matched == 2;
+                sc->in_url = !sc->in_key && sc->field == FIELD_RAW_URL;
+                if (sc->in_key) {
+                    sc->key_len = 0;
+                } else {
+                    sc->key_matched = 0;
+                    sc->field = FIELD_NONE;
+                }
+                if (sc->in_url)
+                    sc->raw_url_len = 0;
+                sc->state = SCAN_STRING;
+                break;
+            case '{':
+            case '[':
+                if (sc->depth == SCAN_MAX_DEPTH)
+                    return -1;
+                if (sc->key_matched)
+                    sc->matched = sc->depth;
+                sc->key_matched = 0;
+                sc->field = FIELD_NONE;
+                sc->stack[sc->depth++] = ch;
+                sc->expect_key = ch == '{';
+                break;
+            case '}':
+            case ']':
+                if (sc->depth == 0)
+                    return -1;
+                // the container closing may be the last one matched
+                if (sc->depth >= 2 && sc->matched > sc->depth - 2)
+                    sc->matched = sc->depth - 2;
+                sc->depth--;
+                sc->key_matched = 0;
+                sc->field = FIELD_NONE;
+                sc->expect_key = 0;
+                break;
+            case ':':
+                sc->expect_key = 0;
+                break;
+            case ',':
+                sc->expect_key = sc->depth > 0 && sc->stack[sc->depth - 1] == '{';
+                sc->key_matched = 0;
+                sc->field = FIELD_NONE;
+                break;
+            default:
+                // whitespace, numbers, true/false/null
+                if (sc->field == FIELD_TRUNCATED && ch == 't')
+                    sc->truncated = 1;
+                break;
+            }
+            break;
+
+        case SCAN_STRING: {
+            // copy the longest run that needs no decoding in one go
+            const char *run = p;
+            while (p < end && *p != '"' && *p != '\\')
+                p++;
+            if (p > run)
+                scan_emit(sc, run, p - run);
+            if (p == end)
+                break;
+            if (*p++ == '"')
+                scan_end_string(sc);
+            else
+                sc->state = SCAN_ESCAPE;
+            break;
+        }
+
+        case SCAN_ESCAPE: {
+            p++;
+            char out = ch;
+            switch (ch) {
+            case 'n': out = '\n'; break;
+            case 't': out = '\t'; break;
+            case 'r': out = '\r'; break;
+            case 'b': out = '\b'; break;
+            case 'f': out = '\f'; break;
+            case 'u':
+                sc->ucs = 0;
+                sc->ucs_digits = 0;
+                sc->state = SCAN_UNICODE;
+                continue;
+            }
+            scan_emit(sc, &out, 1);
+            sc->state = SCAN_STRING;
+            break;
+        }
+
+        case SCAN_UNICODE:
+            p++;
+            if (ch >= '0' && ch <= '9')
+                sc->ucs = sc->ucs * 16 + (ch - '0');
+            else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+                sc->ucs = sc->ucs * 16 + ((ch | 0x20) - 'a' + 10);
+            else
+                return -1;
+            if (++sc->ucs_digits < 4)
+                break;
+            sc->state = SCAN_STRING;
+            if (sc->ucs >= 0xd800 && sc->ucs < 0xdc00) {
+                sc->high_surrogate = sc->ucs;
+            } else if (sc->ucs >= 0xdc00 && sc->ucs < 0xe000 && sc->high_surrogate) {
+                scan_emit_utf8(sc, 0x10000 + ((sc->high_surrogate - 0xd800) << 10) + (sc->ucs - 0xdc00));
+                sc->high_surrogate = 0;
+            } else {
+                scan_emit_utf8(sc, sc->ucs);
+                sc->high_surrogate = 0;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+// one streamed GET. the body is never buffered: each chunk goes straight
+// through the scanner into the spare content buffer
+struct fetch_state {
+    struct gist_conn *conn;
+    struct content_scan scan;
+    struct reply_meta meta;
+    int sized;
+    uint64_t decode_us;
+    // the api's reply was in, the transfer now running reads raw_url
+    int raw;
+};
+
+static size_t fetch_write(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct fetch_state *st = userdata;
+    size_t len = size * nmemb;
+
+    if (!st->sized) {
+        // the content can't be longer than the body, size the buffer once.
+        // a gzipped body can, that just takes a few more doublings
+        curl_off_t cl = -1;
+        curl_easy_getinfo(st->conn->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl);
+        if (cl > 0)
+            string_reserve(st->scan.out, (size_t)cl);
+        st->sized = 1;
+    }
+
+    uint64_t t0 = metrics_now_us();
+    int rc = content_scan_feed(&st->scan, ptr, len);
+    st->decode_us += metrics_now_us() - t0;
+    if (rc != 0) {
+        fprintf(stderr, "JSON parsing failed\n");
+        return 0;
+    }
+    return len;
+}
+
+static void fetch_setup(struct gist_conn *c) {
+    if (!c->fetch) {
+        c->fetch = malloc(sizeof(*c->fetch));
+        if (!c->fetch) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    struct fetch_state *st = c->fetch;
+    memset(st, 0, sizeof(*st));
+    st->conn = c;
+    c->spare.len = 0;
+    c->spare.ptr[0] = '\0';
+    st->scan.out = &c->spare;
+    reply_meta_clear(&st->meta);
+
+    // the handle may have been used for a PATCH last time
+    curl_easy_setopt(c->curl, CURLOPT_CUSTOMREQUEST, NULL);
+    curl_easy_setopt(c->curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(c->curl, CURLOPT_HTTPHEADER,
+                     c->content && c->cond_headers ? c->cond_headers : get_headers);
+    curl_easy_setopt(c->curl, CURLOPT_WRITEFUNCTION, fetch_write);
+    curl_easy_setopt(c->curl, CURLOPT_WRITEDATA, st);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERFUNCTION, header_meta);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERDATA, &st->meta);
+}
+
+// libcurl's timings of the transfer that just completed on c, request
+// being METRIC_GET or METRIC_PATCH with its phases right after it
+static void observe_transfer(struct gist_conn *c, enum metric request) {
+    curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, start = 0, total = 0;
+    long connects = 0;
+    curl_easy_getinfo(c->curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(c->curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(c->curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(c->curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(c->curl, CURLINFO_STARTTRANSFER_TIME_T, &start);
+    curl_easy_getinfo(c->curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(c->curl, CURLINFO_NUM_CONNECTS, &connects);
+    metrics_observe(request, total);
+    // a reused connection skips these, counting its zeros would only
+    // hide what a new one costs
+    if (connects) {
+        metrics_observe(request + 1, dns);
+        metrics_observe(request + 2, connect - dns);
+        if (tls)
+            metrics_observe(request + 3, tls - connect);
+    }
+    metrics_observe(request + 4, start - pretransfer);
+    metrics_observe(request + 5, total - start);
+}
+
+static size_t raw_write(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    string_append(userdata, ptr, size * nmemb);
+    return size * nmemb;
+}
+
+// if the transfer that just ended was the api's 200 for a file it cut
+// off, books that reply and points the handle at the raw_url it gave, to
+// read the whole file in place of the content in spare. returns 1 if so,
+// the caller then runs the handle again the way it ran the first time
+static int fetch_continue_raw(struct gist_conn *c, CURLcode res) {
+    struct fetch_state *st = c->fetch;
+    if (st->raw || res != CURLE_OK || !st->scan.truncated || !st->scan.raw_url[0] ||
+        !st->scan.found || st->scan.depth != 0)
+        return 0;
+    long status = 0;
+    curl_easy_getinfo(c->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status != 200)
+        return 0;
+    observe_transfer(c, METRIC_GET);
+    rate_note(&st->meta, status);
+    metrics_observe(METRIC_JSON_DECODE, st->decode_us);
+
+    st->raw = 1;
+    c->spare.len = 0;
+    c->spare.ptr[0] = '\0';
+    // the api reply's ETag in meta stays what the content is filed under
+    curl_easy_setopt(c->curl, CURLOPT_URL, st->scan.raw_url);
+    curl_easy_setopt(c->curl, CURLOPT_HTTPHEADER, get_headers);
+    curl_easy_setopt(c->curl, CURLOPT_WRITEFUNCTION, raw_write);
+    curl_easy_setopt(c->curl, CURLOPT_WRITEDATA, &c->spare);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERFUNCTION, NULL);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERDATA, NULL);
+    return 1;
+}
+
+// the end of a raw_url read started by fetch_continue_raw
+static const char *raw_complete(struct gist_conn *c, CURLcode res, int *retry) {
+    struct fetch_state *st = c->fetch;
+    curl_easy_setopt(c->curl, CURLOPT_URL, c->url);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "CURL request failed: %s\n", curl_easy_strerror(res));
+        *retry = res != CURLE_URL_MALFORMAT && res != CURLE_UNSUPPORTED_PROTOCOL;
+        return NULL;
+    }
+    observe_transfer(c, METRIC_GET);
+    long status = 0;
+    curl_easy_getinfo(c->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status != 200) {
+        fprintf(stderr, "Failed to fetch truncated gist file: HTTP %ld\n", status);
+        *retry = status >= 500;
+        return NULL;
+    }
+    remember_snapshot(c, st->meta.etag);
+    return c->content;
+}
+
+// *retry is set when the failure may well go away by itself: the
+// network, the server, or a rate limit
+static const char *fetch_complete(struct gist_conn *c, CURLcode res, int *retry) {
+    struct fetch_state *st = c->fetch;
+    curl_easy_setopt(c->curl, CURLOPT_HEADERFUNCTION, NULL);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERDATA, NULL);
+    *retry = 0;
+    if (st->raw)
+        return raw_complete(c, res, retry);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "CURL request failed: %s\n", curl_easy_strerror(res));
+        // a write error is the decoder refusing the body
+        *retry = res != CURLE_WRITE_ERROR && res != CURLE_URL_MALFORMAT &&
+                 res != CURLE_UNSUPPORTED_PROTOCOL;
+        return NULL;
+    }
+    observe_transfer(c, METRIC_GET);
+
+    long status = 0;
+    curl_easy_getinfo(c->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (rate_note(&st->meta, status)) {
+        fprintf(stderr, "Rate limited: HTTP %ld\n", status);
+        *retry = 1;
+        return NULL;
+    }
+    if (status == 304 && c->content) {
+        // unchanged since last time, nothing was transferred or parsed
+        return c->content;
+    }
+    if (status != 200) {
+        fprintf(stderr, "Failed to fetch gist: HTTP %ld\n", status);
+        *retry = status >= 500;
+        return NULL;
+    }
+    if (!st->scan.found || st->scan.depth != 0) {
+        fprintf(stderr, "Invalid JSON structure\n");
+        return NULL;
+    }
+    if (st->scan.truncated) {
+        // fetch_continue_raw takes every other truncated reply
+        fprintf(stderr, "Gist file is truncated and has no raw_url\n");
+        return NULL;
+    }
+    metrics_observe(METRIC_JSON_DECODE, st->decode_us);
+    remember_snapshot(c, st->meta.etag);
+    return c->content;
+}
+
+static const char *fetch_retrying(struct gist_conn *c) {
+    for (int attempt = 0;; attempt++) {
+        long wait = rate_wait(0);
+        if (wait > 0) {
+            fprintf(stderr, "Rate limited for another %ld s\n", (wait + 999) / 1000);
+            return NULL;
+        }
+        fetch_setup(c);
+        CURLcode res = curl_easy_perform(c->curl);
+        if (fetch_continue_raw(c, res))
+            res = curl_easy_perform(c->curl);
+        int retry;
+        const char *content = fetch_complete(c, res, &retry);
+        if (content || !retry || attempt >= rate.retry_max)
+            return content;
+        count_retry();
+        sleep_ms(gist_retry_delay_ms(attempt));
+    }
+}
+
+// hands the leader's result to a connection that waited for it
+static const char *flight_adopt(struct gist_conn *c, const struct flight *f) {
+    if (!f->content)
+        return NULL;
+    if (c->content && c->etag && strcmp(c->etag, f->etag) == 0)
+        return c->content;
+    c->spare.len = 0;
+    string_append_str(&c->spare, f->content);
+    remember_snapshot(c, f->etag);
+    return c->content;
+}
+
+const char *gist_fetch(struct gist_conn *c) {
+    pthread_mutex_lock(&flights_lock);
+    struct flight *f;
+    for (f = flights; f; f = f->next) {
+        if (!f->done && f->leader != c && strcmp(f->url, c->url) == 0)
+            break;
+    }
+    if (f) {
+        // somebody is reading this gist already, their answer will do
+        f->waiters++;
+        while (!f->done)
+            pthread_cond_wait(&flights_cond, &flights_lock);
+        // the result doesn't change any more, and f stays until the
+        // last waiter is done with it
+        pthread_mutex_unlock(&flights_lock);
+        const char *content = flight_adopt(c, f);
+        pthread_mutex_lock(&flights_lock);
+        if (--f->waiters == 0) {
+            free(f->content);
+            free(f);
+        }
+        pthread_mutex_unlock(&flights_lock);
+        pthread_mutex_lock(&rate.lock);
+        rate.stats.coalesced++;
+        pthread_mutex_unlock(&rate.lock);
+        return content;
+    }
+    f = calloc(1, sizeof(*f));
+    if (!f) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    f->url = c->url;
+    f->leader = c;
+    f->next = flights;
+    flights = f;
+    pthread_mutex_unlock(&flights_lock);
+
+    const char *content = fetch_retrying(c);
+
+    pthread_mutex_lock(&flights_lock);
+    for (struct flight **pp = &flights; *pp; pp = &(*pp)->next) {
+        if (*pp == f) {
+            *pp = f->next;
+            break;
+        }
+    }
+    f->done = 1;
+    if (f->waiters) {
+        if (content) {
+            f->content = strdup(content);
+            snprintf(f->etag, sizeof(f->etag), "%s", c->etag ? c->etag : "");
+        }
+        pthread_cond_broadcast(&flights_cond);
+    } else {
+        free(f);
+    }
+    pthread_mutex_unlock(&flights_lock);
+    return content;
+}
+
+int gist_fetch_start(struct gist_conn *c) {
+    if (!c->multi) {
+        c->multi = curl_multi_init();
+        if (!c->multi) {
+            fprintf(stderr, "Failed to initialize CURL\n");
+            return -1;
+        }
+    }
+    c->fetch_done = 0;
+    c->fetch_skipped = 0;
+    if (rate_admit(0) != 0) {
+        // no request until the limit lifts, and none for reads out of
+        // the reserve: what the connection has stands in for the answer
+        c->fetch_skipped = 1;
+        c->fetch_done = 1;
+        return 0;
+    }
+    fetch_setup(c);
+    if (curl_multi_add_handle(c->multi, c->curl) != CURLM_OK) {
+        fprintf(stderr, "Failed to start request\n");
+        return -1;
+    }
+    return 0;
+}
+
+// completions are handed to whichever connection they belong to, the
+// multi handle may be driving others besides c. one that goes on to
+// read raw_url is put back on the multi handle instead
+static int fetch_collect(struct gist_conn *c) {
+    int running, left, restarted = 0;
+    curl_multi_perform(c->multi, &running);
+    CURLMsg *msg;
+    while ((msg = curl_multi_info_read(c->multi, &left))) {
+        struct gist_conn *done = NULL;
+        CURL *easy = msg->easy_handle;
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&done);
+        if (msg->msg != CURLMSG_DONE || !done)
+            continue;
+        if (fetch_continue_raw(done, msg->data.result)) {
+            curl_multi_remove_handle(c->multi, easy);
+            if (curl_multi_add_handle(c->multi, easy) == CURLM_OK) {
+                restarted = 1;
+                continue;
+            }
+            done->fetch_result = CURLE_FAILED_INIT;
+        } else {
+            done->fetch_result = msg->data.result;
+        }
+        done->fetch_done = 1;
+    }
+    if (restarted)
+        curl_multi_perform(c->multi, &running);
+    return c->fetch_done;
+}
+
+int gist_fetch_step(struct gist_conn *c, int fd, int timeout_ms) {
+    if (fetch_collect(c))
+        return 1;
+    struct curl_waitfd wfd = { .fd = fd, .events = CURL_WAIT_POLLIN };
+    curl_multi_poll(c->multi, &wfd, fd >= 0 ? 1 : 0, timeout_ms, NULL);
+    return fetch_collect(c);
+}
+
+const char *gist_fetch_finish(struct gist_conn *c) {
+    if (c->fetch_skipped) {
+        if (!c->content)
+            fprintf(stderr, "Rate limited, nothing fetched yet\n");
+        return c->content;
+    }
+    curl_multi_remove_handle(c->multi, c->curl);
+    // the caller steps again later, that is its retry
+    int retry;
+    return fetch_complete(c, c->fetch_result, &retry);
+}
+
+void gist_fetch_cancel(struct gist_conn *c) {
+    if (c->fetch_skipped)
+        return;
+    // dropping the handle closes its connection mid transfer. spare held
+    // the partial decode, the current content was never touched
+    curl_multi_remove_handle(c->multi, c->curl);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERFUNCTION, NULL);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERDATA, NULL);
+    curl_easy_setopt(c->curl, CURLOPT_URL, c->url);
+}
+
+// FUNCTION TO IGNORE JSON DUMP
+static size_t discard_response(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    (void)ptr;
+    (void)userdata;
+    return size * nmemb;
+}
+
+// errors where the request cannot have reached the server
+static int never_sent(CURLcode res) {
+    switch (res) {
+    case CURLE_UNSUPPORTED_PROTOCOL:
+    case CURLE_URL_MALFORMAT:
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_PEER_FAILED_VERIFICATION:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// one PATCH of the payload. *retry is set when it certainly wasn't
+// applied but might be if sent again: it never left, or a rate limit
+// turned it away
+static int patch_once(struct gist_conn *c, struct curl_slist *headers, struct reply_meta *meta,
+                      int *retry) {
+    *retry = 0;
+    reply_meta_clear(meta);
+    curl_easy_setopt(c->curl, CURLOPT_CUSTOMREQUEST, "PATCH");
+    curl_easy_setopt(c->curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(c->curl, CURLOPT_POSTFIELDS, c->payload.ptr);
+    curl_easy_setopt(c->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)c->payload.len);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERFUNCTION, header_meta);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERDATA, meta);
+
+    // ignore json response
+    curl_easy_setopt(c->curl, CURLOPT_WRITEFUNCTION, discard_response);
+    curl_easy_setopt(c->curl, CURLOPT_WRITEDATA, NULL);
+
+    CURLcode res = curl_easy_perform(c->curl);
+    // don't leave the payload dangling on the handle
+    curl_easy_setopt(c->curl, CURLOPT_POSTFIELDS, NULL);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERFUNCTION, NULL);
+    curl_easy_setopt(c->curl, CURLOPT_HEADERDATA, NULL);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "Failed to update gist: %s\n", curl_easy_strerror(res));
+        *retry = never_sent(res);
+        return never_sent(res) ? GIST_ERROR : GIST_IN_DOUBT;
+    }
+    observe_transfer(c, METRIC_PATCH);
+
+    long status = 0;
+    curl_easy_getinfo(c->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (rate_note(meta, status)) {
+        fprintf(stderr, "Failed to update gist: rate limited, HTTP %ld\n", status);
+        *retry = 1;
+        return GIST_ERROR;
+    }
+    if (status == 412)
+        return GIST_CONFLICT;
+    if (status < 200 || status > 299) {
+        fprintf(stderr, "Failed to update gist: HTTP %ld\n", status);
+        // a 5xx may come from a proxy after the origin took the write
+        return status >= 500 ? GIST_IN_DOUBT : GIST_ERROR;
+    }
+    return GIST_OK;
+}
+
+static int do_update(struct gist_conn *c, const char *updated_content,
+                     struct curl_slist *headers) {
+    // escape straight into the payload, no intermediate copy and no cap.
+    // the buffer is kept on the connection and reused by every PATCH
+    size_t content_len = strlen(updated_content);
+    c->payload.len = 0;
+    uint64_t t0 = metrics_now_us();
+    string_append_str(&c->payload, "{\"files\": {\"" FILE_NAME "\": {\"content\": \"");
+    string_append_json(&c->payload, updated_content, content_len);
+    string_append_str(&c->payload, "\"}}}");
+    metrics_observe(METRIC_JSON_ENCODE, metrics_now_us() - t0);
+
+    // writes may use the reserve reads leave alone. only a PATCH that
+    // certainly wasn't applied is sent again, anything in doubt goes
+    // back to the caller to settle
+    struct reply_meta meta;
+    int rc;
+    for (int attempt = 0;; attempt++) {
+        long wait = rate_wait(1);
+        if (wait > 0) {
+            fprintf(stderr, "Failed to update gist: rate limited for another %ld s\n",
+                    (wait + 999) / 1000);
+            return GIST_ERROR;
+        }
+        int retry;
+        rc = patch_once(c, headers, &meta, &retry);
+        if (!retry || attempt >= rate.retry_max)
+            break;
+        count_retry();
+        sleep_ms(gist_retry_delay_ms(attempt));
+    }
+    if (rc != GIST_OK)
+        return rc;
+
+    // what we wrote is now the current revision, so the next GET can be
+    // answered with a 304 and the next If-Match names the right version
+    c->spare.len = 0;
+    string_append(&c->spare, updated_content, content_len);
+    remember_snapshot(c, meta.etag);
+    return GIST_OK;
+}
+
+int gist_update(struct gist_conn *c, const char *updated_content) {
+    return do_update(c, updated_content, patch_headers);
+}
+
+int gist_update_if_match(struct gist_conn *c, const char *updated_content) {
+    return do_update(c, updated_content, c->match_headers ? c->match_headers : patch_headers);
+}
+
+struct gist_conn *gist_default_conn(void) {
+    return &default_conn;
+}
+
+const char *fetch_gist_content(void) {
+    return gist_fetch(&default_conn);
+}
+
+int update_gist_content(const char *updated_content) {
+    return gist_update(&default_conn, updated_content);
+}
+
+void gist_set_content_handler(void (*fn)(const char *content, void *arg), void *arg) {
+    default_conn.on_content = fn;
+    default_conn.on_content_arg = arg;
+}
@@ -0,0 +1,145 @@
+#ifndef GIST_H
+#define GIST_H
+
+#include <stddef.h>
+#include <curl/curl.h>
+
+#include "strbuf.h"
+
+#define GIST_ID ""
+#define GITHUB_TOKEN ""
+#define FILE_NAME "nfc_data.csv"
+#define API_URL "https://api.github.com/gists/" GIST_ID
+#define GIST_ETAG_MAX 256
+
+struct fetch_state;
+
+// a long-lived easy handle. every connection made through it is kept
+// alive between requests, and all handles share one dns cache, tls
+// session cache and connection pool
+struct gist_conn {
+    CURL *curl;
+    // the gist this connection reads and writes, see gist_conn_set_shard
+    const char *url;
+    // last FILE_NAME content we saw and the ETag it came with. GETs are
+    // sent with If-None-Match so an unchanged gist costs a bodyless 304
+    char *etag;
+    char *content;
+    struct curl_slist *cond_headers;
+    // PATCH headers with If-Match: etag, for gist_update_if_match
+    struct curl_slist *match_headers;
+    // content points into body. a GET decodes into spare and the two
+    // are swapped on success, so both buffers are recycled and a failed
+    // fetch leaves the current content intact
+    struct string body;
+    struct string spare;
+    // PATCH payload, reused between updates
+    struct string payload;
+    // bumped whenever content is replaced by a 200 reply
+    unsigned long generation;
+    // called with the new content as soon as a 200 reply has been
+    // parsed, while the transfer is still being wound up
+    void (*on_content)(const char *content, void *arg);
+    void *on_content_arg;
+    // decoder state of the GET in progress
+    struct fetch_state *fetch;
+    // set up on first use by gist_fetch_start, unless the connection
+    // was given a shared one
+    CURLM *multi;
+    int multi_shared;
+    int fetch_done;
+    CURLcode fetch_result;
+    // the rate limit held the fetch back, nothing was sent
+    int fetch_skipped;
+};
+
+// call once before any other gist_* function / after the last one.
+// ATM_API_URL in the environment overrides API_URL, e.g. to point the
+// client at a local stand-in server
+//
+// every reply's X-RateLimit-Remaining/-Reset is tracked across all
+// connections. a 429, or a 403 saying the quota is spent, holds every
+// request back until the limit lifts (Retry-After or the reset time).
+// requests that failed for a reason that may pass (network, 5xx, rate
+// limit) are retried with jittered exponential backoff, at most
+// ATM_RETRY_MAX times (default 4); a PATCH only when it certainly
+// wasn't applied. the last ATM_RATE_RESERVE requests of the quota
+// (default 20) are kept for writes: GETs wait for the next window
+// instead, and the stepped fetch keeps the content it has
+int gist_global_init(void);
+void gist_global_cleanup(void);
+
+int gist_conn_init(struct gist_conn *c);
+void gist_conn_cleanup(struct gist_conn *c);
+
+// ATM_SHARD_URLS="url,url,..." splits the accounts across that many
+// gists, each holding the rows whose regno hashes to it. without it
+// there is one shard, the gist at API_URL. a connection starts out on
+// shard 0
+size_t gist_shard_count(void);
+size_t gist_shard_of(const char *regno);
+void gist_conn_set_shard(struct gist_conn *c, size_t shard);
+// lets several connections fetch side by side: stepping any of them
+// drives the transfers of all. multi stays the caller's and must
+// outlive the connections
+void gist_conn_use_multi(struct gist_conn *c, CURLM *multi);
+
+// returns the csv content of FILE_NAME, NULL on failure. the string is
+// owned by the connection and stays valid until its next fetch. calls
+// from several threads for the same gist share one request
+const char *gist_fetch(struct gist_conn *c);
+
+// the same fetch in steps, for callers that have to keep serving the
+// keyboard while it runs. returns 0 if the transfer was started
+int gist_fetch_start(struct gist_conn *c);
+// drives the transfer, sleeping at most timeout_ms or until fd (if not
+// -1) is readable. returns 1 once the transfer is complete
+int gist_fetch_step(struct gist_conn *c, int fd, int timeout_ms);
+// result of a completed transfer, as gist_fetch would have returned it
+const char *gist_fetch_finish(struct gist_conn *c);
+// abandons a started transfer. the current content stays as it was
+void gist_fetch_cancel(struct gist_conn *c);
+
+// gist_update results
+#define GIST_OK 0
+// the request was not applied
+#define GIST_ERROR -1
+// the gist changed since c last saw it, nothing was written
+#define GIST_CONFLICT -2
+// the request may or may not have been applied, e.g. the connection
+// dropped before the reply came in
+#define GIST_IN_DOUBT -3
+
+// overwrites FILE_NAME unconditionally. on success the written content
+// becomes the connection's snapshot, tagged with the ETag of the reply
+int gist_update(struct gist_conn *c, const char *updated_content);
+// same, but only if the gist is still at the revision of c's snapshot
+// (If-Match). without a known ETag this is the same as gist_update
+int gist_update_if_match(struct gist_conn *c, const char *updated_content);
+
+struct gist_rate_stats {
+    // requests sent, replies that were a rate limit, requests sent
+    // again, fetches answered by another thread's request, and times a
+    // read was held back to leave the rest of the quota to writes
+    unsigned long requests;
+    unsigned long throttled;
+    unsigned long retries;
+    unsigned long coalesced;
+    unsigned long deferred;
+    // what's left of the quota as far as we know, -1 if unknown
+    long remaining;
+};
+
+void gist_get_rate_stats(struct gist_rate_stats *out);
+// how long to wait before trying again after attempt + 1 failures in a
+// row: the same jittered backoff the requests use, and at least until a
+// rate limit lifts
+long gist_retry_delay_ms(int attempt);
+
+// same as above on the process wide connection set up by gist_global_init
+struct gist_conn *gist_default_conn(void);
+const char *fetch_gist_content(void);
+int update_gist_content(const char *updated_content);
+void gist_set_content_handler(void (*fn)(const char *content, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "csv.h"
+#include "journal.h"
+#include "metrics.h"
+
+static long long wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void format_record(struct string *s, const struct journal_record *r) {
+    char type[2] = { r->type, ',' };
+    string_append(s, type, 2);
+    if (r->type == 'R') {
+        string_append_str(s, r->regno);
+        string_append_str(s, ",");
+        string_append_int(s, r->pin);
+        string_append_str(s, ",");
+        string_append_int(s, r->balance);
+        string_append_str(s, ",");
+        string_append_str(s, r->name);
+        string_append_str(s, "\n");
+        return;
+    }
+    string_append_int(s, (long)r->seq);
+    string_append_str(s, ",");
+    string_append_int(s, (long)r->ms);
+    if (r->type == 'B' || r->type == 'P' || r->type == 'N' || r->type == 'X') {
+        string_append_str(s, ",");
+        string_append_str(s, r->regno);
+        string_append_str(s, ",");
+    }
+    if (r->type == 'B' || r->type == 'X') {
+        string_append_int(s, r->delta);
+        string_append_str(s, ",");
+        string_append_int(s, r->balance);
+    } else if (r->type == 'P') {
+        string_append_int(s, r->pin);
+    } else if (r->type == 'N') {
+        string_append_str(s, r->name);
+    }
+    string_append_str(s, "\n");
+}
+
+// splits line at commas into at most n fields, the last takes the rest
+static int split(char *line, char **f, int n) {
+    int k = 0;
+    f[k++] = line;
+    while (k < n && (line = strchr(line, ','))) {
+        *line++ = '\0';
+        f[k++] = line;
+    }
+    return k;
+}
+
+static int parse_ulong(const char *s, unsigned long *out) {
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(s, &end, 10);
+    if (errno || end == s || *end)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+static int parse_int(const char *s, int *out) {
+    return csv_parse_int(s, strlen(s), out);
+}
+
+static int copy_field(char *dst, size_t cap, const char *src) {
+    size_t n = strlen(src);
+    if (n == 0 || n >= cap)
+        return -1;
+    memcpy(dst, src, n + 1);
+    return 0;
+}
+
+// line without its '\n'. returns 0 if it is a well formed record
+static int parse_record(char *line, struct journal_record *r) {
+    char *f[6];
+    memset(r, 0, sizeof(*r));
+    if (line[0] == '\0' || line[1] != ',')
+        return -1;
+    r->type = line[0];
+    unsigned long ms;
+
+    switch (r->type) {
+    case 'R':
+        if (split(line + 2, f, 4) != 4 ||
+            copy_field(r->regno, sizeof(r->regno), f[0]) != 0 ||
+            parse_int(f[1], &r->pin) != 0 || parse_int(f[2], &r->balance) != 0 ||
+            strlen(f[3]) >= sizeof(r->name))
+            return -1;
+        strcpy(r->name, f[3]);
+        return 0;
+    case 'F':
+    case 'C':
+        if (split(line + 2, f, 2) != 2 || parse_ulong(f[0], &r->seq) != 0 ||
+            parse_ulong(f[1], &ms) != 0)
+            return -1;
+        r->ms = (long long)ms;
+        return 0;
+    case 'B':
+    case 'X':
+    case 'P':
+    case 'N': {
+        int n = r->type == 'B' || r->type == 'X' ? 5 : 4;
+        if (split(line + 2, f, n) != n || parse_ulong(f[0], &r->seq) != 0 ||
+            parse_ulong(f[1], &ms) != 0 || copy_field(r->regno, sizeof(r->regno), f[2]) != 0)
+            return -1;
+        r->ms = (long long)ms;
+        if (r->type == 'B' || r->type == 'X')
+            return parse_int(f[3], &r->delta) == 0 && parse_int(f[4], &r->balance) == 0 ? 0 : -1;
+        if (r->type == 'P')
+            return parse_int(f[3], &r->pin);
+        if (strlen(f[3]) >= sizeof(r->name))
+            return -1;
+        strcpy(r->name, f[3]);
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+// replays the existing records and cuts off a torn last line, so new
+// appends start on a line of their own
+static int replay_file(struct journal *j,
+                       void (*replay)(const struct journal_record *r, void *arg), void *arg) {
+    FILE *f = fdopen(dup(j->fd), "r");
+    if (!f)
+        return -1;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    size_t good = 0;
+    while ((n = getline(&line, &cap, f)) > 0) {
+        if (line[n - 1] != '\n')
+            break;
+        good += n;
+        line[n - 1] = '\0';
+        struct journal_record r;
+        if (parse_record(line, &r) != 0)
+            continue;
+        if (r.type != 'R' && r.seq > j->written_seq)
+            j->written_seq = r.seq;
+        if (replay)
+            replay(&r, arg);
+    }
+    free(line);
+    fclose(f);
+
+    off_t end = lseek(j->fd, 0, SEEK_END);
+    if (end > (off_t)good && ftruncate(j->fd, good) != 0)
+        return -1;
+    j->size = good;
+    return 0;
+}
+
+int journal_open(struct journal *j, const char *path,
+                 void (*replay)(const struct journal_record *r, void *arg), void *arg) {
+    memset(j, 0, sizeof(*j));
+    j->path = strdup(path);
+    j->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (!j->path || j->fd < 0) {
+        perror(path);
+        if (j->fd >= 0)
+            close(j->fd);
+        free(j->path);
+        j->path = NULL;
+        return -1;
+    }
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    init_string(&j->buf);
+    init_string(&j->out);
+    if (replay_file(j, replay, arg) != 0) {
+        perror(path);
+        journal_close(j);
+        return -1;
+    }
+    return 0;
+}
+
+void journal_close(struct journal *j) {
+    if (!j->path)
+        return;
+    if (j->fd >= 0) {
+        journal_sync(j);
+        close(j->fd);
+    }
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->cond);
+    free(j->buf.ptr);
+    free(j->out.ptr);
+    free(j->path);
+    memset(j, 0, sizeof(*j));
+    j->fd = -1;
+}
+
+void journal_append(struct journal *j, struct journal_record *r) {
+    if (!r->ms)
+        r->ms = wall_ms();
+    pthread_mutex_lock(&j->lock);
+    format_record(&j->buf, r);
+    j->appended++;
+    if (r->type != 'R' && r->seq > j->buf_seq)
+        j->buf_seq = r->seq;
+    pthread_mutex_unlock(&j->lock);
+}
+
+static int write_all(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+int journal_sync(struct journal *j) {
+    int rc = 0;
+    pthread_mutex_lock(&j->lock);
+    unsigned long target = j->appended;
+    while (j->durable < target) {
+        if (j->syncing) {
+            // someone else is writing, their fsync may well cover us
+            pthread_cond_wait(&j->cond, &j->lock);
+            continue;
+        }
+        // lead a group commit of everything buffered so far
+        struct string t = j->out;
+        j->out = j->buf;
+        j->buf = t;
+        j->buf.len = 0;
+        unsigned long upto = j->appended;
+        unsigned long seq = j->buf_seq;
+        size_t size = j->size;
+        j->syncing = 1;
+        pthread_mutex_unlock(&j->lock);
+
+        uint64_t t0 = metrics_now_us();
+        rc = write_all(j->fd, j->out.ptr, j->out.len);
+        if (rc == 0)
+            rc = fdatasync(j->fd);
+        metrics_observe(METRIC_JOURNAL_SYNC, metrics_now_us() - t0);
+        if (rc != 0) {
+            perror(j->path);
+            // drop a partial line so a retry doesn't leave garbage behind
+            if (ftruncate(j->fd, size) != 0)
+                perror(j->path);
+        }
+
+        pthread_mutex_lock(&j->lock);
+        j->syncing = 0;
+        if (rc == 0) {
+            j->durable = upto;
+            j->size += j->out.len;
+            if (seq > j->written_seq)
+                j->written_seq = seq;
+        } else {
+            // put the records back in front of whatever came in meanwhile
+            string_append(&j->out, j->buf.ptr, j->buf.len);
+            t = j->buf;
+            j->buf = j->out;
+            j->out = t;
+        }
+        j->out.len = 0;
+        pthread_cond_broadcast(&j->cond);
+        if (rc != 0)
+            break;
+    }
+    pthread_mutex_unlock(&j->lock);
+    return rc;
+}
+
+size_t journal_size(struct journal *j) {
+    pthread_mutex_lock(&j->lock);
+    size_t n = j->size;
+    pthread_mutex_unlock(&j->lock);
+    return n;
+}
+
+static int fsync_dir_of(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char dir[4096];
+    if (!slash) {
+        strcpy(dir, ".");
+    } else {
+        size_t n = slash == path ? 1 : (size_t)(slash - path);
+        if (n >= sizeof(dir))
+            return -1;
+        memcpy(dir, path, n);
+        dir[n] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// tmp file, fsync, rename over path
+static int write_file_atomic(const char *path, const char *data, size_t len) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    int rc = write_all(fd, data, len);
+    if (rc == 0)
+        rc = fsync(fd);
+    close(fd);
+    if (rc == 0)
+        rc = rename(tmp, path);
+    if (rc != 0)
+        unlink(tmp);
+    return rc;
+}
+
+// called with the lock held and no sync in progress
+static int compact_locked(struct journal *j, const char *snapshot_csv, unsigned long checkpoint) {
+    char name[4096];
+    // the snapshot goes first: once it is in place the old segment isn't
+    // needed to rebuild the state
+    snprintf(name, sizeof(name), "%s.snap", j->path);
+    if (write_file_atomic(name, snapshot_csv, strlen(snapshot_csv)) != 0) {
+        perror(name);
+        return -1;
+    }
+
+    // archive the old segment under a second name, then replace it with
+    // a fresh one. the journal path exists at every point in between
+    snprintf(name, sizeof(name), "%s.%lu", j->path, checkpoint);
+    unlink(name);
+    if (link(j->path, name) != 0) {
+        perror(name);
+        return -1;
+    }
+    struct journal_record c = { .type = 'C', .seq = checkpoint, .ms = wall_ms() };
+    struct string first;
+    init_string(&first);
+    format_record(&first, &c);
+    int fd = -1;
+    if (write_file_atomic(j->path, first.ptr, first.len) == 0)
+        fd = open(j->path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        perror(j->path);
+        free(first.ptr);
+        return -1;
+    }
+    close(j->fd);
+    j->fd = fd;
+    j->size = first.len;
+    free(first.ptr);
+    fsync_dir_of(j->path);
+    return 0;
+}
+
+int journal_compact(struct journal *j, const char *snapshot_csv, unsigned long checkpoint) {
+    pthread_mutex_lock(&j->lock);
+    while (j->syncing)
+        pthread_cond_wait(&j->cond, &j->lock);
+    // a change past the checkpoint is already in this segment. it would
+    // be lost from the new one, so try again another time
+    int rc = 1;
+    if (j->written_seq <= checkpoint)
+        rc = compact_locked(j, snapshot_csv, checkpoint);
+    pthread_mutex_unlock(&j->lock);
+    return rc;
+}
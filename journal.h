@@ -0,0 +1,78 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "accounts.h"
+#include "strbuf.h"
+
+// append-only log of account changes, one text line per record:
+//
+//   B,seq,ms,regno,delta,balance   balance moved by delta, to balance
+//   P,seq,ms,regno,pin             pin set
+//   N,seq,ms,regno,name            name set (last, may hold anything but '\n')
+//   X,seq,ms,regno,amount,balance  the write up to seq took withdrawals
+//                                  of amount that left the row at balance,
+//                                  below zero
+//   F,seq,ms                       a write of every change up to seq is
+//                                  about to be sent to the gist
+//   R,regno,pin,balance,name       a row as that write leaves it, follows F
+//   C,seq,ms                       every change up to seq is in the gist
+//
+// seq only grows, also across restarts, ms is wall clock time. appends
+// are buffered; journal_sync makes them durable, and callers that sync
+// at the same time share one write and one fdatasync (group commit)
+
+struct journal_record {
+    char type;
+    unsigned long seq;
+    long long ms;
+    char regno[REGNO_LEN];
+    int delta;
+    int balance;
+    int pin;
+    char name[NAME_LEN];
+};
+
+struct journal {
+    int fd;
+    char *path;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // appended, not written yet
+    struct string buf;
+    // being written by the caller leading the current group commit
+    struct string out;
+    // records appended so far / records known to be on disk
+    unsigned long appended;
+    unsigned long durable;
+    // highest seq in buf / highest seq that has reached the file
+    unsigned long buf_seq;
+    unsigned long written_seq;
+    int syncing;
+    size_t size;
+};
+
+// opens or creates the journal at path and hands every intact record
+// already in it to replay, oldest first. returns 0 on success
+int journal_open(struct journal *j, const char *path,
+                 void (*replay)(const struct journal_record *r, void *arg), void *arg);
+// syncs whatever is still buffered
+void journal_close(struct journal *j);
+
+// r->ms is filled in when zero
+void journal_append(struct journal *j, struct journal_record *r);
+// returns once everything appended before the call is on disk. 0 on
+// success, -1 if the write failed (the records stay buffered)
+int journal_sync(struct journal *j);
+
+// bytes in the current segment
+size_t journal_size(struct journal *j);
+// writes snapshot_csv to <path>.snap and starts a new segment that
+// begins with "C,checkpoint". the old one is kept as <path>.<checkpoint>
+// for the audit trail. skipped (returns 1) if records newer than
+// checkpoint already reached the file, 0 on success, -1 on error
+int journal_compact(struct journal *j, const char *snapshot_csv, unsigned long checkpoint);
+
+#endif
@@ -0,0 +1,234 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+// bucket i counts observations of at most 2^i microseconds, the last
+// one everything longer
+#define METRIC_BUCKETS 32
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[METRIC_BUCKETS];
+};
+
+static struct histogram hists[METRIC_COUNT];
+
+// name is for the text table. histograms of one family are exported
+// under one Prometheus name, told apart by their labels. a family is
+// written as one group where it first turns up, and that first entry
+// carries the help
+static const struct {
+    const char *name;
+    const char *family;
+    const char *labels;
+    const char *help;
+} info[METRIC_COUNT] = {
+    [METRIC_GET] = { "gist_get", "atm_gist_request_seconds", "request=\"get\"",
+        "Gist requests, start to finish." },
+    [METRIC_GET_DNS] = { "gist_get_dns", "atm_gist_phase_seconds", "request=\"get\",phase=\"dns\"",
+        "Gist request phases. dns, connect and tls only count requests that opened a connection." },
+    [METRIC_GET_CONNECT] = { "gist_get_connect", "atm_gist_phase_seconds", "request=\"get\",phase=\"connect\"",
+        NULL },
+    [METRIC_GET_TLS] = { "gist_get_tls", "atm_gist_phase_seconds", "request=\"get\",phase=\"tls\"",
+        NULL },
+    [METRIC_GET_WAIT] = { "gist_get_wait", "atm_gist_phase_seconds", "request=\"get\",phase=\"wait\"",
+        NULL },
+    [METRIC_GET_TRANSFER] = { "gist_get_transfer", "atm_gist_phase_seconds", "request=\"get\",phase=\"transfer\"",
+        NULL },
+    [METRIC_PATCH] = { "gist_patch", "atm_gist_request_seconds", "request=\"patch\"", NULL },
+    [METRIC_PATCH_DNS] = { "gist_patch_dns", "atm_gist_phase_seconds", "request=\"patch\",phase=\"dns\"",
+        NULL },
+    [METRIC_PATCH_CONNECT] = { "gist_patch_connect", "atm_gist_phase_seconds", "request=\"patch\",phase=\"connect\"",
+        NULL },
+    [METRIC_PATCH_TLS] = { "gist_patch_tls", "atm_gist_phase_seconds", "request=\"patch\",phase=\"tls\"",
+        NULL },
+    [METRIC_PATCH_WAIT] = { "gist_patch_wait", "atm_gist_phase_seconds", "request=\"patch\",phase=\"wait\"",
+        NULL },
+    [METRIC_PATCH_TRANSFER] = { "gist_patch_transfer", "atm_gist_phase_seconds", "request=\"patch\",phase=\"transfer\"",
+        NULL },
+    [METRIC_JSON_DECODE] = { "json_decode", "atm_json_seconds", "op=\"decode\"",
+        "Gist content decoded from or encoded into JSON." },
+    [METRIC_JSON_ENCODE] = { "json_encode", "atm_json_seconds", "op=\"encode\"", NULL },
+    [METRIC_CSV_LOAD] = { "csv_load", "atm_csv_seconds", "op=\"load\"",
+        "Account table parsed from or written to CSV." },
+    [METRIC_CSV_BUILD] = { "csv_build", "atm_csv_seconds", "op=\"build\"", NULL },
+    [METRIC_FLUSH] = { "flush", "atm_flush_seconds", NULL,
+        "Write queue flushes, rereads and retries included." },
+    [METRIC_JOURNAL_SYNC] = { "journal_sync", "atm_journal_sync_seconds", NULL,
+        "Journal group commits." },
+};
+
+uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static unsigned bucket_of(uint64_t us) {
+    if (us <= 1)
+        return 0;
+    unsigned b = 64 - __builtin_clzll(us - 1);
+    return b < METRIC_BUCKETS ? b : METRIC_BUCKETS - 1;
+}
+
+void metrics_observe(enum metric m, uint64_t us) {
+    struct histogram *h = &hists[m];
+    __atomic_add_fetch(&h->buckets[bucket_of(us)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&h->max_us, &max, us, 1, __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED))
+        ;
+}
+
+// a copy to export from. writers may be halfway through an observation,
+// so the buckets can be off by one from count; count is taken from them
+static void snapshot(enum metric m, struct histogram *out) {
+    const struct histogram *h = &hists[m];
+    out->count = 0;
+    for (unsigned b = 0; b < METRIC_BUCKETS; b++) {
+        out->buckets[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        out->count += out->buckets[b];
+    }
+    out->sum_us = __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+    out->max_us = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+}
+
+// upper bound of the bucket holding the p-th percentile
+static uint64_t percentile_us(const struct histogram *h, double p) {
+    uint64_t rank = (uint64_t)(p / 100 * h->count + 0.5), seen = 0;
+    if (rank < 1)
+        rank = 1;
+    for (unsigned b = 0; b < METRIC_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank)
+            return ((uint64_t)1 << b) < h->max_us ? (uint64_t)1 << b : h->max_us;
+    }
+    return h->max_us;
+}
+
+void metrics_write_text(FILE *f) {
+    fprintf(f, "%-20s %10s %10s %10s %10s %10s\n", "metric", "count", "mean us", "p50 us",
+            "p99 us", "max us");
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        struct histogram h;
+        snapshot(m, &h);
+        if (!h.count)
+            continue;
+        fprintf(f, "%-20s %10llu %10.1f %10llu %10llu %10llu\n", info[m].name,
+                (unsigned long long)h.count, (double)h.sum_us / h.count,
+                (unsigned long long)percentile_us(&h, 50), (unsigned long long)percentile_us(&h, 99),
+                (unsigned long long)h.max_us);
+    }
+}
+
+static void write_histogram(FILE *f, int m) {
+    const char *family = info[m].family;
+    const char *labels = info[m].labels;
+    struct histogram h;
+    snapshot(m, &h);
+    uint64_t cumulative = 0;
+    for (unsigned b = 0; b < METRIC_BUCKETS - 1; b++) {
+        cumulative += h.buckets[b];
+        fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", family, labels ? labels : "",
+                labels ? "," : "", (double)((uint64_t)1 << b) / 1e6,
+                (unsigned long long)cumulative);
+    }
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", family, labels ? labels : "",
+            labels ? "," : "", (unsigned long long)h.count);
+    fprintf(f, "%s_sum%s%s%s %.6f\n", family, labels ? "{" : "", labels ? labels : "",
+            labels ? "}" : "", h.sum_us / 1e6);
+    fprintf(f, "%s_count%s%s%s %llu\n", family, labels ? "{" : "", labels ? labels : "",
+            labels ? "}" : "", (unsigned long long)h.count);
+}
+
+// the enum keeps each request next to its phases, so the get and patch
+// entries of a family aren't next to each other there
+void metrics_write_prometheus(FILE *f) {
+    for (int first = 0; first < METRIC_COUNT; first++) {
+        const char *family = info[first].family;
+        int written = 0;
+        for (int m = 0; m < first && !written; m++)
+            written = strcmp(info[m].family, family) == 0;
+        if (written)
+            continue;
+        fprintf(f, "# HELP %s %s\n", family, info[first].help);
+        fprintf(f, "# TYPE %s histogram\n", family);
+        for (int m = first; m < METRIC_COUNT; m++) {
+            if (strcmp(info[m].family, family) == 0)
+                write_histogram(f, m);
+        }
+    }
+}
+
+static const char *export_path;
+static volatile sig_atomic_t export_requested;
+
+static void on_usr1(int sig) {
+    (void)sig;
+    export_requested = 1;
+}
+
+// written next to path and renamed over it, so a scraper never reads
+// half a file
+static void export_to(const char *path, void (*write)(FILE *)) {
+    size_t len = strlen(path) + 5;
+    char *tmp = malloc(len);
+    if (!tmp) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    snprintf(tmp, len, "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        perror(tmp);
+        free(tmp);
+        return;
+    }
+    write(f);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        perror(path);
+        remove(tmp);
+    }
+    free(tmp);
+}
+
+static void export_all(void) {
+    export_to(export_path, metrics_write_prometheus);
+    size_t len = strlen(export_path) + 5;
+    char *txt = malloc(len);
+    if (!txt) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    snprintf(txt, len, "%s.txt", export_path);
+    export_to(txt, metrics_write_text);
+    free(txt);
+}
+
+void metrics_init(void) {
+    const char *path = getenv("ATM_METRICS");
+    if (!path || !*path)
+        return;
+    export_path = path;
+    signal(SIGUSR1, on_usr1);
+}
+
+void metrics_poll(void) {
+    if (export_path && export_requested) {
+        export_requested = 0;
+        export_all();
+    }
+}
+
+void metrics_finish(void) {
+    if (export_path)
+        export_all();
+}
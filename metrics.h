@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// latency histograms for the slow paths: the gist requests phase by
+// phase (from libcurl's CURLINFO_*_TIME_T), the JSON and CSV work around
+// them, flushes and journal syncs. recording is a handful of relaxed
+// atomic adds and no locks, so it is always on.
+//
+// with ATM_METRICS=path the histograms are written to path in the
+// Prometheus text format and to path.txt as a plain table, at exit and
+// whenever the process gets SIGUSR1
+
+// every request is followed by its phases, in this order
+enum metric {
+    METRIC_GET,
+    METRIC_GET_DNS,
+    METRIC_GET_CONNECT,
+    METRIC_GET_TLS,
+    METRIC_GET_WAIT,
+    METRIC_GET_TRANSFER,
+    METRIC_PATCH,
+    METRIC_PATCH_DNS,
+    METRIC_PATCH_CONNECT,
+    METRIC_PATCH_TLS,
+    METRIC_PATCH_WAIT,
+    METRIC_PATCH_TRANSFER,
+    // decoding the content out of a GET reply, and escaping it into a
+    // PATCH payload
+    METRIC_JSON_DECODE,
+    METRIC_JSON_ENCODE,
+    METRIC_CSV_LOAD,
+    METRIC_CSV_BUILD,
+    // one write queue flush, rereads and retries included
+    METRIC_FLUSH,
+    METRIC_JOURNAL_SYNC,
+    METRIC_COUNT
+};
+
+uint64_t metrics_now_us(void);
+void metrics_observe(enum metric m, uint64_t us);
+
+void metrics_write_text(FILE *f);
+void metrics_write_prometheus(FILE *f);
+
+// reads ATM_METRICS and sets up SIGUSR1. poll writes the files if the
+// signal came since the last call, finish writes them unconditionally.
+// both are no-ops without ATM_METRICS
+void metrics_init(void);
+void metrics_poll(void);
+void metrics_finish(void);
+
+#endif
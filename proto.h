@@ -0,0 +1,46 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+
+#include "accounts.h"
+
+// wire format between atm and atmd over a unix stream socket. requests
+// and replies are the same fixed size struct in host byte order (both
+// ends run on one machine), so framing is just reading whole structs.
+// a client may pipeline requests, replies come back in order
+
+#define ATMD_SOCKET_DEFAULT "/tmp/atmd.sock"
+
+enum proto_op {
+    // regno + pin. the reply carries the whole row
+    PROTO_LOGIN = 1,
+    // value is the delta. the reply carries the new balance
+    PROTO_BALANCE,
+    PROTO_SET_NAME,
+    PROTO_SET_PIN,
+    // replied to once everything this client changed has been written
+    PROTO_FLUSH,
+};
+
+enum proto_status {
+    PROTO_OK = 0,
+    PROTO_NOT_FOUND,
+    PROTO_BAD_PIN,
+    PROTO_INSUFFICIENT,
+    // not logged in as regno, or an unknown op
+    PROTO_DENIED,
+    PROTO_FAILED,
+};
+
+struct proto_msg {
+    uint8_t op;
+    uint8_t status;
+    uint16_t reserved;
+    int32_t pin;
+    int32_t value;
+    char regno[REGNO_LEN];
+    char name[NAME_LEN];
+};
+
+#endif
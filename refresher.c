@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "refresher.h"
+
+// how often a refresh in progress looks up from the network to check
+// for stop, on top of being woken by it
+#define STEP_MS 100
+
+struct snapshot {
+    struct account_table table;
+    unsigned long generation;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    struct store *store;
+    long interval_ms;
+    int running;
+    int stopping;
+    // a pipe whose read end refresh_step watches, so stop doesn't have
+    // to wait for the network
+    int wake[2];
+
+    // kicks handed out, and the newest one a refresh was started for
+    unsigned long requested;
+    unsigned long started;
+    // what the kicks since then asked for: one regno's rows, or all
+    char regno[REGNO_LEN];
+    int all;
+    // the newest kick a finished refresh covers, and how it went
+    unsigned long completed;
+    int ok;
+
+    // the published snapshot. readers count themselves in under the
+    // epoch they saw; a snapshot that was swapped out is freed once
+    // nobody is left under the epoch it was current in
+    struct snapshot *current;
+    unsigned epoch;
+    unsigned long readers[2];
+} r = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .wake = { -1, -1 },
+};
+
+static unsigned read_lock(void) {
+    for (;;) {
+        unsigned e = __atomic_load_n(&r.epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&r.readers[e & 1], 1, __ATOMIC_SEQ_CST);
+        // the writer may have moved on between the two, in which case
+        // it won't be waiting for us
+        if (__atomic_load_n(&r.epoch, __ATOMIC_SEQ_CST) == e)
+            return e;
+        __atomic_sub_fetch(&r.readers[e & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void read_unlock(unsigned e) {
+    __atomic_sub_fetch(&r.readers[e & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+int refresher_lookup(const char *regno, struct account *out, unsigned long *generation) {
+    unsigned e = read_lock();
+    const struct snapshot *snap = __atomic_load_n(&r.current, __ATOMIC_SEQ_CST);
+    const struct account *a = snap ? account_table_find(&snap->table, regno) : NULL;
+    if (a)
+        *out = *a;
+    if (generation)
+        *generation = snap ? snap->generation : 0;
+    read_unlock(e);
+    return a != NULL;
+}
+
+// only ever called from the refresher thread, so there is one writer
+static void publish(const struct account_table *t, unsigned long generation) {
+    struct snapshot *snap = calloc(1, sizeof(*snap));
+    if (!snap) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    account_table_set_rows(&snap->table, t->rows, t->count);
+    snap->generation = generation;
+
+    struct snapshot *old = __atomic_exchange_n(&r.current, snap, __ATOMIC_SEQ_CST);
+    unsigned e = __atomic_fetch_add(&r.epoch, 1, __ATOMIC_SEQ_CST);
+    // readers hold a snapshot for one lookup, this is a short wait
+    while (__atomic_load_n(&r.readers[e & 1], __ATOMIC_SEQ_CST))
+        sched_yield();
+    if (old) {
+        account_table_free(&old->table);
+        free(old);
+    }
+}
+
+static int stopping(void) {
+    return __atomic_load_n(&r.stopping, __ATOMIC_SEQ_CST);
+}
+
+static int refresh(const char *regno) {
+    struct store *s = r.store;
+    if (s->ops->refresh_start(s, regno) != 0)
+        return -1;
+    while (!s->ops->refresh_step(s, r.wake[0], STEP_MS)) {
+        if (stopping()) {
+            s->ops->refresh_cancel(s);
+            return -1;
+        }
+    }
+    int rc = s->ops->refresh_finish(s);
+    // shards that came in are published even if others failed
+    const struct snapshot *cur = r.current;
+    if (s->generation != (cur ? cur->generation : 0))
+        publish(s->table, s->generation);
+    return rc;
+}
+
+static struct timespec deadline_after(long ms) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += ms / 1000;
+    t.tv_nsec += (ms % 1000) * 1000000L;
+    if (t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+    return t;
+}
+
+static void *refresher_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&r.lock);
+    // the first pass fills the snapshot in
+    int due = 1;
+    while (!r.stopping) {
+        if (!due && r.requested == r.started) {
+            struct timespec until = deadline_after(r.interval_ms);
+            while (!r.stopping && r.requested == r.started) {
+                if (pthread_cond_timedwait(&r.cond, &r.lock, &until) == ETIMEDOUT) {
+                    due = 1;
+                    break;
+                }
+            }
+            continue;
+        }
+
+        // a timed pass refreshes everything, and takes any kicks along
+        unsigned long target = r.requested;
+        int all = due || r.all;
+        char regno[REGNO_LEN];
+        snprintf(regno, sizeof(regno), "%s", r.regno);
+        r.started = target;
+        r.all = 0;
+        r.regno[0] = '\0';
+        pthread_mutex_unlock(&r.lock);
+
+        int rc = refresh(all ? NULL : regno);
+
+        pthread_mutex_lock(&r.lock);
+        if (all)
+            due = 0;
+        r.completed = target;
+        r.ok = rc == 0;
+        pthread_cond_broadcast(&r.cond);
+    }
+    pthread_mutex_unlock(&r.lock);
+    return NULL;
+}
+
+int refresher_start(struct store *s, long interval_ms) {
+    r.store = s;
+    r.interval_ms = interval_ms;
+    if (pipe(r.wake) != 0) {
+        perror("pipe");
+        return -1;
+    }
+    if (pthread_create(&r.thread, NULL, refresher_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start refresh thread\n");
+        return -1;
+    }
+    r.running = 1;
+    return 0;
+}
+
+void refresher_stop(void) {
+    if (!r.running)
+        return;
+    pthread_mutex_lock(&r.lock);
+    __atomic_store_n(&r.stopping, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.lock);
+    if (write(r.wake[1], "", 1) < 0)
+        perror("refresher");
+    pthread_join(r.thread, NULL);
+    r.running = 0;
+    close(r.wake[0]);
+    close(r.wake[1]);
+    r.wake[0] = r.wake[1] = -1;
+    if (r.current) {
+        account_table_free(&r.current->table);
+        free(r.current);
+        r.current = NULL;
+    }
+}
+
+unsigned long refresher_kick(const char *regno) {
+    pthread_mutex_lock(&r.lock);
+    // kicks for different regnos before the refresher got to them are
+    // served by one refresh of everything
+    if (!regno || (r.requested != r.started && strcmp(r.regno, regno) != 0))
+        r.all = 1;
+    else
+        snprintf(r.regno, sizeof(r.regno), "%s", regno);
+    unsigned long ticket = ++r.requested;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.lock);
+    return ticket;
+}
+
+int refresher_wait(unsigned long ticket, int timeout_ms) {
+    pthread_mutex_lock(&r.lock);
+    struct timespec until = deadline_after(timeout_ms);
+    while (r.completed < ticket && !r.stopping) {
+        if (pthread_cond_timedwait(&r.cond, &r.lock, &until) == ETIMEDOUT)
+            break;
+    }
+    int rc = r.completed < ticket ? (r.stopping ? -1 : 0) : r.ok ? 1 : -1;
+    pthread_mutex_unlock(&r.lock);
+    return rc;
+}
@@ -0,0 +1,34 @@
+#ifndef REFRESHER_H
+#define REFRESHER_H
+
+#include "accounts.h"
+#include "store.h"
+
+// keeps a snapshot of the store's rows warm from a thread of its own:
+// the whole store is refreshed every interval, and sooner for the rows
+// someone asked about. every refresh that changed something publishes
+// a new immutable snapshot with a pointer swap; readers never wait for
+// the network or for the refresher, and the old snapshot is freed once
+// the readers that could have seen it are done (RCU style).
+//
+// while the refresher runs it owns the store's refresh_* calls and its
+// table, everything else on the store may be used from any thread
+
+int refresher_start(struct store *s, long interval_ms);
+void refresher_stop(void);
+
+// asks for the rows stored alongside regno (every row if NULL) to be
+// refreshed now. returns a ticket for refresher_wait
+unsigned long refresher_kick(const char *regno);
+// waits at most timeout_ms for a refresh started after the ticket was
+// handed out. returns 1 once one has succeeded, -1 if it failed and 0
+// if it is still going
+int refresher_wait(unsigned long ticket, int timeout_ms);
+
+// copies regno's row out of the latest snapshot, never blocking.
+// returns 1 if it is there, 0 if not or before the first snapshot.
+// *generation is the store generation of the snapshot (0 before the
+// first one)
+int refresher_lookup(const char *regno, struct account *out, unsigned long *generation);
+
+#endif
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "snapshot.h"
+
+static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void *grow(void *p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void put_varint(struct string *out, unsigned long v) {
+    char buf[10];
+    size_t n = 0;
+    do {
+        buf[n] = (char)(v & 0x7f);
+        v >>= 7;
+        if (v)
+            buf[n] |= (char)0x80;
+        n++;
+    } while (v);
+    string_append(out, buf, n);
+}
+
+static void put_int(struct string *out, int v) {
+    // zigzag, so small negative numbers stay short too
+    put_varint(out, ((unsigned)v << 1) ^ (unsigned)(v >> 31));
+}
+
+// s as the length of the prefix it shares with prev, then the length
+// and bytes of the rest. sorted or numbered regnos cost a byte or two
+static void put_str(struct string *out, const char *s, const char *prev) {
+    size_t shared = 0;
+    while (s[shared] && s[shared] == prev[shared])
+        shared++;
+    size_t n = strlen(s + shared);
+    char lens[2] = { (char)shared, (char)n };
+    string_append(out, lens, 2);
+    string_append(out, s + shared, n);
+}
+
+// returns -1 past the end of the buffer or on a varint that runs on
+static int get_varint(const unsigned char **p, const unsigned char *end, unsigned long *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p == end)
+            return -1;
+        unsigned char b = *(*p)++;
+        *v |= (unsigned long)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static int get_int(const unsigned char **p, const unsigned char *end, int *v) {
+    unsigned long u;
+    if (get_varint(p, end, &u) != 0 || u > 0xffffffffUL)
+        return -1;
+    unsigned x = (unsigned)u;
+    *v = (int)((x >> 1) ^ -(x & 1));
+    return 0;
+}
+
+static int get_str(const unsigned char **p, const unsigned char *end, char *out, const char *prev,
+                   size_t cap) {
+    if (end - *p < 2)
+        return -1;
+    size_t shared = (*p)[0], n = (*p)[1];
+    *p += 2;
+    if (shared > strlen(prev) || shared + n >= cap || (size_t)(end - *p) < n)
+        return -1;
+    memcpy(out, prev, shared);
+    memcpy(out + shared, *p, n);
+    out[shared + n] = '\0';
+    *p += n;
+    return 0;
+}
+
+void snapshot_append(const struct account *rows, size_t n, struct string *out) {
+    struct string raw;
+    init_string(&raw);
+    put_varint(&raw, n);
+    // strings against the row before, numbers as the difference to it
+    for (size_t i = 0; i < n; i++)
+        put_str(&raw, rows[i].regno, i ? rows[i - 1].regno : "");
+    for (size_t i = 0; i < n; i++)
+        put_int(&raw, (int)((unsigned)rows[i].pin - (i ? (unsigned)rows[i - 1].pin : 0)));
+    for (size_t i = 0; i < n; i++)
+        put_str(&raw, rows[i].name, i ? rows[i - 1].name : "");
+    for (size_t i = 0; i < n; i++)
+        put_int(&raw, (int)((unsigned)rows[i].balance - (i ? (unsigned)rows[i - 1].balance : 0)));
+
+    // the record length, then the deflated records
+    struct string packed;
+    init_string(&packed);
+    put_varint(&packed, raw.len);
+    uLongf zlen = compressBound(raw.len);
+    string_reserve(&packed, zlen);
+    if (compress2((Bytef *)packed.ptr + packed.len, &zlen, (const Bytef *)raw.ptr, raw.len,
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    packed.len += zlen;
+
+    string_reserve(out, SNAPSHOT_MAGIC_LEN + (packed.len + 2) / 3 * 4 + 1);
+    string_append(out, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    const unsigned char *p = (const unsigned char *)packed.ptr;
+    char *o = out->ptr + out->len;
+    size_t i = 0;
+    for (; i + 3 <= packed.len; i += 3) {
+        unsigned v = p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+        *o++ = b64[v >> 18];
+        *o++ = b64[(v >> 12) & 63];
+        *o++ = b64[(v >> 6) & 63];
+        *o++ = b64[v & 63];
+    }
+    if (i < packed.len) {
+        unsigned v = p[i] << 16 | (i + 1 < packed.len ? p[i + 1] << 8 : 0);
+        *o++ = b64[v >> 18];
+        *o++ = b64[(v >> 12) & 63];
+        *o++ = i + 1 < packed.len ? b64[(v >> 6) & 63] : '=';
+        *o++ = '=';
+    }
+    *o++ = '\n';
+    *o = '\0';
+    out->len = o - out->ptr;
+    free(raw.ptr);
+    free(packed.ptr);
+}
+
+static int b64_value(unsigned char c) {
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    return c == '+' ? 62 : c == '/' ? 63 : -1;
+}
+
+// base64 of p..end into a new buffer, NULL if it isn't valid
+static unsigned char *unbase64(const char *p, const char *end, size_t *len) {
+    while (end > p && (end[-1] == '\r' || end[-1] == '='))
+        end--;
+    unsigned char *out = malloc((end - p) / 4 * 3 + 3);
+    if (!out) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    size_t n = 0;
+    unsigned v = 0;
+    int bits = 0;
+    for (; p < end; p++) {
+        int d = b64_value((unsigned char)*p);
+        if (d < 0) {
+            free(out);
+            return NULL;
+        }
+        v = v << 6 | (unsigned)d;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = (unsigned char)(v >> bits);
+        }
+    }
+    *len = n;
+    return out;
+}
+
+// the records of a snapshot, appended to *rows once all of them read
+static int decode_records(const unsigned char *r, const unsigned char *end, struct account **rows,
+                          size_t *n, size_t *cap) {
+    unsigned long count;
+    // every row takes at least six bytes
+    if (get_varint(&r, end, &count) != 0 || count > (size_t)(end - r) / 6)
+        return -1;
+    if (*n + count > *cap) {
+        *cap = *n + count;
+        *rows = grow(*rows, *cap * sizeof(**rows));
+    }
+    struct account *a = *rows + *n;
+    int d;
+    for (size_t i = 0; i < count; i++) {
+        if (get_str(&r, end, a[i].regno, i ? a[i - 1].regno : "", REGNO_LEN) != 0)
+            return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (get_int(&r, end, &d) != 0)
+            return -1;
+        a[i].pin = (int)((i ? (unsigned)a[i - 1].pin : 0) + (unsigned)d);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (get_str(&r, end, a[i].name, i ? a[i - 1].name : "", NAME_LEN) != 0)
+            return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (get_int(&r, end, &d) != 0)
+            return -1;
+        a[i].balance = (int)((i ? (unsigned)a[i - 1].balance : 0) + (unsigned)d);
+    }
+    if (r != end)
+        return -1;
+    *n += count;
+    return 0;
+}
+
+// inflates the packed form (record length, deflated records) and reads
+// the records out of it
+static int decode_packed(const unsigned char *q, const unsigned char *end, struct account **rows,
+                         size_t *n, size_t *cap) {
+    unsigned long raw_len;
+    // deflate can't do better than about 1000:1, anything claiming more
+    // is garbage and not worth allocating for
+    if (get_varint(&q, end, &raw_len) != 0 || raw_len > (end - q) * 1032UL + 64)
+        return -1;
+    unsigned char *raw = malloc(raw_len ? raw_len : 1);
+    if (!raw) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    uLongf got = raw_len;
+    int rc = -1;
+    if (uncompress(raw, &got, q, end - q) == Z_OK && got == raw_len)
+        rc = decode_records(raw, raw + raw_len, rows, n, cap);
+    free(raw);
+    return rc;
+}
+
+int snapshot_decode(const char *p, const char *end, struct account **rows, size_t *n, size_t *cap) {
+    if ((size_t)(end - p) < SNAPSHOT_MAGIC_LEN || memcmp(p, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0)
+        return -1;
+    size_t packed_len;
+    unsigned char *packed = unbase64(p + SNAPSHOT_MAGIC_LEN, end, &packed_len);
+    if (!packed)
+        return -1;
+    int rc = decode_packed(packed, packed + packed_len, rows, n, cap);
+    free(packed);
+    return rc;
+}
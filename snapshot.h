@@ -0,0 +1,35 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+
+#include "accounts.h"
+#include "strbuf.h"
+
+// compact encoding of the account rows, the alternative to csv for the
+// content of a gist. one line per table:
+//
+//   ATMB1:<base64>\n
+//
+// where the base64 wraps the length of the records as a varint followed
+// by the records deflated with zlib. the records are stored a column at
+// a time (every regno, then every pin, every name, every balance) so
+// like values sit together, and each against the row before: strings
+// as the length of the prefix they share with it and the rest, numbers
+// as the difference in a zigzag varint. the digit in the magic is the
+// version.
+// a line like that can sit next to csv lines, so the shards of a store
+// may be in either format
+
+#define SNAPSHOT_MAGIC "ATMB1:"
+#define SNAPSHOT_MAGIC_LEN 6
+
+// appends rows[0..n) as one line
+void snapshot_append(const struct account *rows, size_t n, struct string *out);
+
+// decodes the line from p (at the magic) up to end and appends its rows
+// to the malloc'd array *rows, *n of *cap slots in use. returns 0, or
+// -1 if the line isn't a snapshot this version can read
+int snapshot_decode(const char *p, const char *end, struct account **rows, size_t *n, size_t *cap);
+
+#endif
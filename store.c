@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "store.h"
+
+static const struct store_ops *backends[] = { &store_gist_ops, &store_file_ops };
+
+int store_open(struct store *s, const char *spec, struct account_table *table) {
+    memset(s, 0, sizeof(*s));
+    s->table = table;
+    if (!spec || !*spec)
+        spec = "gist";
+
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strlen(backends[i]->name) == len && strncmp(backends[i]->name, spec, len) == 0) {
+            s->ops = backends[i];
+            if (s->ops->open(s, colon ? colon + 1 : NULL) != 0) {
+                s->ops = NULL;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown store: %s\n", spec);
+    return -1;
+}
+
+int store_refresh(struct store *s) {
+    if (s->ops->refresh_start(s, NULL) != 0)
+        return -1;
+    while (!s->ops->refresh_step(s, -1, 1000))
+        ;
+    return s->ops->refresh_finish(s);
+}
+
+size_t store_close(struct store *s) {
+    if (!s->ops)
+        return 0;
+    size_t unsaved = s->ops->close(s);
+    s->ops = NULL;
+    return unsaved;
+}
@@ -0,0 +1,83 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+
+#include "accounts.h"
+
+// where the accounts live. ATM_STORE picks the backend:
+//
+//   gist          the default. rows are read from the gist (gist.h) and
+//                 changes go out through the write queue (writeq.h),
+//                 shown in the table until they are written. with
+//                 ATM_CACHE=path the rows of every complete read are
+//                 also kept in path, and loaded from there when the
+//                 gist can't be reached on start
+//   file:PATH     fixed width binary records in a local file that is
+//                 mapped into memory. changes are made in place and
+//                 msync'd, nothing ever waits on the network
+//
+// the caller's table is a copy of the rows that refresh keeps up to
+// date. changes go to the store and are not applied to the table
+
+struct store;
+
+// lets the caller wait for a flush without holding on to the store
+struct store_ticket {
+    unsigned long target;
+    unsigned long attempts;
+};
+
+struct store_ops {
+    const char *name;
+    // arg is whatever followed "name:" in the spec, NULL if nothing did
+    int (*open)(struct store *s, const char *arg);
+    // refresh in steps, like gist_fetch_start and friends. step waits at
+    // most timeout_ms or until fd (if not -1) is readable and returns 1
+    // once done, finish returns 0 if the table is now current. a local
+    // backend is done as soon as it has started.
+    // with a regno only the rows stored alongside it need to be current,
+    // which for a sharded gist means fetching one shard instead of all
+    int (*refresh_start)(struct store *s, const char *regno);
+    int (*refresh_step)(struct store *s, int fd, int timeout_ms);
+    int (*refresh_finish)(struct store *s);
+    void (*refresh_cancel)(struct store *s);
+
+    // balance is the row's balance after delta as the caller sees it.
+    // returns 0, or -1 if the store turned down a withdrawal because
+    // the row it holds can't cover it (another process got there first).
+    // the gist can only tell once the change is written, see writeq.h
+    int (*add_balance)(struct store *s, const char *regno, int delta, int balance);
+    void (*set_name)(struct store *s, const char *regno, const char *name);
+    void (*set_pin)(struct store *s, const char *regno, int pin);
+    // makes the changes so far durable. 0 on success
+    int (*commit)(struct store *s);
+    // as writeq_flush_start / writeq_flush_wait
+    struct store_ticket (*flush_start)(struct store *s);
+    int (*flush_wait)(struct store *s, struct store_ticket *t, int timeout_ms);
+
+    // returns the number of changes that could not be saved
+    size_t (*close)(struct store *s);
+};
+
+struct store {
+    const struct store_ops *ops;
+    struct account_table *table;
+    // bumped whenever refresh replaced the rows of table
+    unsigned long generation;
+    void *impl;
+};
+
+// spec as in ATM_STORE, NULL or "" for the default. table is loaded by
+// the first refresh. returns 0 on success
+int store_open(struct store *s, const char *spec, struct account_table *table);
+// refresh_start + step + finish of every row, blocking. when it fails
+// the table may still have been loaded from a cache, which generation
+// tells
+int store_refresh(struct store *s);
+size_t store_close(struct store *s);
+
+extern const struct store_ops store_gist_ops;
+extern const struct store_ops store_file_ops;
+
+#endif
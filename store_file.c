@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gist.h"
+#include "store.h"
+
+// a local file of fixed width records, mapped shared so every process
+// on the machine works on the same pages:
+//
+//   header        FILE_HEADER_SIZE bytes, struct file_header
+//   records       count times struct account, in native byte order
+//
+// changes are stores into the mapping. balances move with an atomic
+// add, so terminals sharing the file never lose each other's deposits.
+// commit msyncs the pages written since the last one.
+//
+// a missing file is created from the csv in ATM_STORE_SEED, or from
+// the gist (all of its shards) when that isn't set
+
+#define FILE_MAGIC "ATMSTOR1"
+#define FILE_HEADER_SIZE 64
+
+struct file_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t count;
+    // bumped by every change, so a refresh can tell nothing moved
+    uint64_t version;
+};
+
+_Static_assert(sizeof(struct file_header) <= FILE_HEADER_SIZE, "header too big");
+_Static_assert(sizeof(int) == 4, "records assume a 32 bit int");
+
+static struct {
+    int fd;
+    char *map;
+    size_t map_len;
+    struct file_header *header;
+    struct account *rows;
+    size_t count;
+    // regno index over rows, row + 1 per bucket like account_table's
+    uint32_t *index;
+    size_t index_cap;
+    // version the table was last loaded at
+    uint64_t loaded;
+    // bytes of the mapping written since the last commit
+    size_t dirty_end;
+} fs = { .fd = -1 };
+
+// the account table's index, over the mapped rows
+static void build_index(void) {
+    fs.index_cap = account_index_cap(fs.count);
+    fs.index = malloc(fs.index_cap * sizeof(*fs.index));
+    if (!fs.index) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    account_index_build(fs.index, fs.index_cap, fs.rows, fs.count);
+}
+
+static struct account *find(const char *regno) {
+    return account_index_find(fs.index, fs.index_cap, fs.rows, regno);
+}
+
+static void touched(const struct account *a) {
+    size_t end = (const char *)(a + 1) - fs.map;
+    if (end > fs.dirty_end)
+        fs.dirty_end = end;
+    __atomic_add_fetch(&fs.header->version, 1, __ATOMIC_RELEASE);
+}
+
+// the rows of every shard of the gist, one after the other
+static char *fetch_all(void) {
+    if (gist_global_init() != 0)
+        return NULL;
+    struct string csv;
+    init_string(&csv);
+    struct gist_conn c;
+    for (size_t k = 0; csv.ptr && k < gist_shard_count(); k++) {
+        const char *content = NULL;
+        if (gist_conn_init(&c) == 0) {
+            gist_conn_set_shard(&c, k);
+            content = gist_fetch(&c);
+            if (content)
+                string_append_lines(&csv, content);
+            gist_conn_cleanup(&c);
+        }
+        if (!content) {
+            free(csv.ptr);
+            csv.ptr = NULL;
+        }
+    }
+    gist_global_cleanup();
+    return csv.ptr;
+}
+
+// writes a new store at path from the seed csv
+static int create(const char *path) {
+    const char *seed = getenv("ATM_STORE_SEED");
+    char *csv = NULL;
+    if (seed && *seed) {
+        if (!(csv = read_file(seed))) {
+            perror(seed);
+            return -1;
+        }
+    } else if (!(csv = fetch_all())) {
+        fprintf(stderr, "Failed to retrieve data\n");
+        return -1;
+    }
+
+    struct account_table t = {0};
+    int loaded = account_table_load(&t, csv);
+    free(csv);
+    // fixed width records have no room for a line that isn't a row, and
+    // a store without it would lose the account for good
+    if (loaded == 0 && t.rejected)
+        fprintf(stderr, "Not creating %s: %zu line(s) of the accounts can't be stored\n", path,
+                t.rejected);
+    if (loaded != 0 || t.rejected) {
+        account_table_free(&t);
+        return -1;
+    }
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    int rc = -1;
+    if (f) {
+        char header[FILE_HEADER_SIZE] = {0};
+        struct file_header h = { .record_size = sizeof(struct account), .count = (uint32_t)t.count };
+        memcpy(h.magic, FILE_MAGIC, sizeof(h.magic));
+        memcpy(header, &h, sizeof(h));
+        rc = fwrite(header, sizeof(header), 1, f) == 1 ? 0 : -1;
+        for (size_t i = 0; rc == 0 && i < t.count; i++) {
+            // copied field by field so the padding is zeros, not heap
+            struct account a;
+            memset(&a, 0, sizeof(a));
+            strcpy(a.regno, t.rows[i].regno);
+            strcpy(a.name, t.rows[i].name);
+            a.pin = t.rows[i].pin;
+            a.balance = t.rows[i].balance;
+            rc = fwrite(&a, sizeof(a), 1, f) == 1 ? 0 : -1;
+        }
+        if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+            rc = -1;
+        fclose(f);
+    }
+    if (rc == 0)
+        rc = rename(tmp, path);
+    if (rc != 0) {
+        perror(tmp);
+        unlink(tmp);
+    }
+    account_table_free(&t);
+    return rc;
+}
+
+// maps fs.fd and checks the header
+static int map_file(void) {
+    struct stat st;
+    if (fstat(fs.fd, &st) != 0 || st.st_size < FILE_HEADER_SIZE)
+        return -1;
+    fs.map_len = st.st_size;
+    fs.map = mmap(NULL, fs.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fs.fd, 0);
+    if (fs.map == MAP_FAILED) {
+        fs.map = NULL;
+        return -1;
+    }
+    fs.header = (struct file_header *)fs.map;
+    fs.rows = (struct account *)(fs.map + FILE_HEADER_SIZE);
+    fs.count = fs.header->count;
+    if (memcmp(fs.header->magic, FILE_MAGIC, sizeof(fs.header->magic)) != 0 ||
+        fs.header->record_size != sizeof(struct account) ||
+        FILE_HEADER_SIZE + fs.count * sizeof(struct account) > fs.map_len)
+        return -1;
+    return 0;
+}
+
+static int file_open(struct store *s, const char *path) {
+    (void)s;
+    if (!path || !*path) {
+        fprintf(stderr, "Usage: ATM_STORE=file:PATH\n");
+        return -1;
+    }
+    fs.fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fs.fd < 0 && errno == ENOENT && create(path) == 0)
+        fs.fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fs.fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (map_file() != 0) {
+        fprintf(stderr, "Not an account store: %s\n", path);
+        if (fs.map)
+            munmap(fs.map, fs.map_len);
+        close(fs.fd);
+        memset(&fs, 0, sizeof(fs));
+        fs.fd = -1;
+        return -1;
+    }
+    build_index();
+    return 0;
+}
+
+// the mapping is always current, so a refresh is a copy, and not even
+// that when the version says nothing was written since the last one
+static int file_refresh_start(struct store *s, const char *regno) {
+    (void)regno;
+    uint64_t v = __atomic_load_n(&fs.header->version, __ATOMIC_ACQUIRE);
+    if (s->generation && v == fs.loaded)
+        return 0;
+    account_table_set_rows(s->table, fs.rows, fs.count);
+    fs.loaded = v;
+    s->generation++;
+    return 0;
+}
+
+static int file_refresh_step(struct store *s, int fd, int timeout_ms) {
+    (void)s;
+    (void)fd;
+    (void)timeout_ms;
+    return 1;
+}
+
+static int file_refresh_finish(struct store *s) {
+    (void)s;
+    return 0;
+}
+
+static void file_refresh_cancel(struct store *s) {
+    (void)s;
+}
+
+static int file_add_balance(struct store *s, const char *regno, int delta, int balance) {
+    (void)s;
+    (void)balance;
+    struct account *a = find(regno);
+    if (!a)
+        return 0;
+    // the caller checked funds against its copy of the row, which other
+    // processes on the file may have spent meanwhile. the check that
+    // counts is against the mapped balance, in the same atomic step
+    int cur = __atomic_load_n(&a->balance, __ATOMIC_RELAXED);
+    do {
+        if (delta < 0 && (long long)cur + delta < 0)
+            return -1;
+    } while (!__atomic_compare_exchange_n(&a->balance, &cur, cur + delta, 1, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    touched(a);
+    return 0;
+}
+
+static void file_set_name(struct store *s, const char *regno, const char *name) {
+    (void)s;
+    struct account *a = find(regno);
+    if (!a)
+        return;
+    char buf[NAME_LEN] = {0};
+    snprintf(buf, sizeof(buf), "%s", name);
+    memcpy(a->name, buf, sizeof(a->name));
+    touched(a);
+}
+
+static void file_set_pin(struct store *s, const char *regno, int pin) {
+    (void)s;
+    struct account *a = find(regno);
+    if (!a)
+        return;
+    a->pin = pin;
+    touched(a);
+}
+
+static int file_commit(struct store *s) {
+    (void)s;
+    if (!fs.dirty_end)
+        return 0;
+    // the header page is always among the dirty ones (version), and
+    // msync only writes pages that were actually modified
+    if (msync(fs.map, fs.dirty_end, MS_SYNC) != 0) {
+        perror("msync");
+        return -1;
+    }
+    fs.dirty_end = 0;
+    return 0;
+}
+
+static struct store_ticket file_flush_start(struct store *s) {
+    (void)s;
+    struct store_ticket t = {0};
+    return t;
+}
+
+// nothing is ever queued, a flush is just a commit
+static int file_flush_wait(struct store *s, struct store_ticket *t, int timeout_ms) {
+    (void)t;
+    (void)timeout_ms;
+    return file_commit(s) == 0 ? 1 : -1;
+}
+
+static size_t file_close(struct store *s) {
+    size_t unsaved = file_commit(s) == 0 ? 0 : 1;
+    munmap(fs.map, fs.map_len);
+    close(fs.fd);
+    free(fs.index);
+    memset(&fs, 0, sizeof(fs));
+    fs.fd = -1;
+    return unsaved;
+}
+
+const struct store_ops store_file_ops = {
+    .name = "file",
+    .open = file_open,
+    .refresh_start = file_refresh_start,
+    .refresh_step = file_refresh_step,
+    .refresh_finish = file_refresh_finish,
+    .refresh_cancel = file_refresh_cancel,
+    .add_balance = file_add_balance,
+    .set_name = file_set_name,
+    .set_pin = file_set_pin,
+    .commit = file_commit,
+    .flush_start = file_flush_start,
+    .flush_wait = file_flush_wait,
+    .close = file_close,
+};
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gist.h"
+#include "store.h"
+#include "writeq.h"
+
+// the gist as a store: refresh is a conditional GET per shard, all of
+// them side by side on one multi handle, and changes go through the
+// write queue. the table is every shard's rows one after the other,
+// with the changes still on their way applied on top
+
+static struct {
+    struct gist_conn *conns;
+    size_t count;
+    CURLM *multi;
+    // shards with a GET under way
+    unsigned char *busy;
+    // conns[k].generation the table was last built from
+    unsigned long *built;
+    struct string csv;
+    // queued changes when the refresh started and whether all of them
+    // were written by then. rows fetched otherwise may or may not have
+    // them, and loading those would undo or double them
+    unsigned long queued;
+    int idle;
+    // new rows arrived that couldn't be loaded for that reason. the next
+    // refresh loads them once the queue has caught up, even if the gist
+    // hasn't changed since
+    int stale;
+    // ATM_CACHE: where the rows of the last complete read are kept, and
+    // whether the table came from there
+    const char *cache;
+    int from_cache;
+} gs;
+
+static int queue_idle(unsigned long *queued) {
+    struct writeq_stats st;
+    writeq_get_stats(&st);
+    *queued = st.queued;
+    return st.queued == st.flushed;
+}
+
+// tmp file, fsync, rename over the cache. a cache that can't be written
+// only costs the next start without the network
+static void save_cache(const struct account_table *t) {
+    gs.csv.len = 0;
+    account_table_append_compact(t, &gs.csv);
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", gs.cache);
+    FILE *f = fopen(tmp, "w");
+    int rc = -1;
+    if (f) {
+        rc = fwrite(gs.csv.ptr, 1, gs.csv.len, f) == gs.csv.len ? 0 : -1;
+        if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+            rc = -1;
+        fclose(f);
+    }
+    if (rc == 0)
+        rc = rename(tmp, gs.cache);
+    if (rc != 0)
+        unlink(tmp);
+}
+
+// the gist can't be read: the rows of the last run that could are
+// better than none
+static void load_cache(struct store *s) {
+    char *rows = read_file(gs.cache);
+    if (!rows)
+        return;
+    if (account_table_load(s->table, rows) == 0) {
+        writeq_apply_unsaved(s->table);
+        s->generation++;
+        gs.from_cache = 1;
+    }
+    free(rows);
+}
+
+static void load(struct store *s) {
+    int settled = gs.idle && writeq_settle(gs.queued);
+    // the very first load has nothing to protect, the unsaved changes go
+    // on top of it
+    if (s->generation && !settled) {
+        gs.stale = 1;
+        return;
+    }
+    int complete = 1;
+    for (size_t k = 0; k < gs.count; k++)
+        complete &= gs.conns[k].content != NULL;
+    // shards missing from the read would take their cached rows away
+    if (!complete && gs.cache) {
+        if (!s->generation)
+            load_cache(s);
+        gs.stale = 1;
+        return;
+    }
+    gs.csv.len = 0;
+    for (size_t k = 0; k < gs.count; k++) {
+        if (gs.conns[k].content)
+            string_append_lines(&gs.csv, gs.conns[k].content);
+        gs.built[k] = gs.conns[k].generation;
+    }
+    if (account_table_load(s->table, gs.csv.ptr) != 0)
+        return;
+    if (complete && gs.cache)
+        save_cache(s->table);
+    writeq_apply_unsaved(s->table);
+    s->generation++;
+    gs.stale = 0;
+    gs.from_cache = 0;
+}
+
+static void *alloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (!p) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int gist_open(struct store *s, const char *arg) {
+    (void)s;
+    (void)arg;
+    if (gist_global_init() != 0)
+        return -1;
+    const char *cache = getenv("ATM_CACHE");
+    gs.cache = cache && *cache ? cache : NULL;
+    gs.count = gist_shard_count();
+    gs.conns = alloc(gs.count, sizeof(*gs.conns));
+    gs.busy = alloc(gs.count, sizeof(*gs.busy));
+    gs.built = alloc(gs.count, sizeof(*gs.built));
+    init_string(&gs.csv);
+    gs.multi = curl_multi_init();
+    if (!gs.multi) {
+        fprintf(stderr, "Failed to initialize CURL\n");
+        return -1;
+    }
+    for (size_t k = 0; k < gs.count; k++) {
+        if (gist_conn_init(&gs.conns[k]) != 0)
+            return -1;
+        gist_conn_set_shard(&gs.conns[k], k);
+        gist_conn_use_multi(&gs.conns[k], gs.multi);
+    }
+    return writeq_start();
+}
+
+static int gist_refresh_start(struct store *s, const char *regno) {
+    (void)s;
+    gs.idle = queue_idle(&gs.queued);
+    size_t first = regno ? gist_shard_of(regno) : 0;
+    size_t last = regno ? first + 1 : gs.count;
+    int started = 0;
+    for (size_t k = first; k < last; k++) {
+        if (!gs.busy[k] && gist_fetch_start(&gs.conns[k]) == 0)
+            gs.busy[k] = 1;
+        started |= gs.busy[k];
+    }
+    return started ? 0 : -1;
+}
+
+static int gist_refresh_step(struct store *s, int fd, int timeout_ms) {
+    (void)s;
+    // every GET is on the same multi handle, stepping one drives them all
+    for (size_t k = 0; k < gs.count; k++) {
+        if (gs.busy[k] && !gs.conns[k].fetch_done) {
+            gist_fetch_step(&gs.conns[k], fd, timeout_ms);
+            break;
+        }
+    }
+    for (size_t k = 0; k < gs.count; k++) {
+        if (gs.busy[k] && !gs.conns[k].fetch_done)
+            return 0;
+    }
+    return 1;
+}
+
+static int gist_refresh_finish(struct store *s) {
+    int rc = 0;
+    int changed = gs.stale;
+    int reached = 0;
+    for (size_t k = 0; k < gs.count; k++) {
+        if (!gs.busy[k])
+            continue;
+        gs.busy[k] = 0;
+        if (!gist_fetch_finish(&gs.conns[k])) {
+            rc = -1;
+            continue;
+        }
+        reached |= !gs.conns[k].fetch_skipped;
+        if (gs.conns[k].generation != gs.built[k])
+            changed = 1;
+    }
+    // the gist is back, so is the queue's backlog if it has one
+    if (reached)
+        writeq_resume();
+    // the shards that did come in are loaded even if others failed, and
+    // with nothing at all yet the cache stands in
+    if (changed || (rc != 0 && !s->generation && gs.cache))
+        load(s);
+    return rc;
+}
+
+static void gist_refresh_cancel(struct store *s) {
+    (void)s;
+    for (size_t k = 0; k < gs.count; k++) {
+        if (gs.busy[k])
+            gist_fetch_cancel(&gs.conns[k]);
+        gs.busy[k] = 0;
+    }
+}
+
+static int gist_add_balance(struct store *s, const char *regno, int delta, int balance) {
+    (void)s;
+    writeq_add_balance(regno, delta, balance);
+    return 0;
+}
+
+static void gist_set_name(struct store *s, const char *regno, const char *name) {
+    (void)s;
+    writeq_set_name(regno, name);
+}
+
+static void gist_set_pin(struct store *s, const char *regno, int pin) {
+    (void)s;
+    writeq_set_pin(regno, pin);
+}
+
+static int gist_commit(struct store *s) {
+    (void)s;
+    return writeq_commit();
+}
+
+static struct store_ticket gist_flush_start(struct store *s) {
+    (void)s;
+    struct writeq_ticket w = writeq_flush_start();
+    struct store_ticket t = { w.target, w.attempts };
+    return t;
+}
+
+static int gist_flush_wait(struct store *s, struct store_ticket *t, int timeout_ms) {
+    (void)s;
+    struct writeq_ticket w = { t->target, t->attempts };
+    int rc = writeq_flush_wait(&w, timeout_ms);
+    t->target = w.target;
+    t->attempts = w.attempts;
+    return rc;
+}
+
+static size_t gist_close(struct store *s) {
+    size_t unsaved = writeq_stop();
+    gist_refresh_cancel(s);
+    for (size_t k = 0; k < gs.count; k++)
+        gist_conn_cleanup(&gs.conns[k]);
+    if (gs.multi)
+        curl_multi_cleanup(gs.multi);
+    free(gs.conns);
+    free(gs.busy);
+    free(gs.built);
+    free(gs.csv.ptr);
+    memset(&gs, 0, sizeof(gs));
+    gist_global_cleanup();
+    return unsaved;
+}
+
+const struct store_ops store_gist_ops = {
+    .name = "gist",
+    .open = gist_open,
+    .refresh_start = gist_refresh_start,
+    .refresh_step = gist_refresh_step,
+    .refresh_finish = gist_refresh_finish,
+    .refresh_cancel = gist_refresh_cancel,
+    .add_balance = gist_add_balance,
+    .set_name = gist_set_name,
+    .set_pin = gist_set_pin,
+    .commit = gist_commit,
+    .flush_start = gist_flush_start,
+    .flush_wait = gist_flush_wait,
+    .close = gist_close,
+};
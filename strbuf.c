@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strbuf.h"
+
+void init_string(struct string *s) {
+    s->len = 0;
+    s->cap = 64;
+    s->ptr = malloc(s->cap);
+    if (s->ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    s->ptr[0] = '\0';
+}
+
+size_t writefunc(void *ptr, size_t size, size_t nmemb, struct string *s) {
+    string_append(s, ptr, size * nmemb);
+    return size * nmemb;
+}
+
+void string_reserve(struct string *s, size_t extra) {
+    size_t need = s->len + extra + 1;
+    if (need <= s->cap)
+        return;
+    size_t cap = s->cap ? s->cap : 64;
+    while (cap < need)
+        cap *= 2;
+    s->ptr = realloc(s->ptr, cap);
+    if (s->ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    s->cap = cap;
+}
+
+void string_append(struct string *s, const char *src, size_t n) {
+    string_reserve(s, n);
+    memcpy(s->ptr + s->len, src, n);
+    s->len += n;
+    s->ptr[s->len] = '\0';
+}
+
+void string_append_str(struct string *s, const char *src) {
+    string_append(s, src, strlen(src));
+}
+
+void string_append_lines(struct string *s, const char *src) {
+    size_t n = strlen(src);
+    string_append(s, src, n);
+    if (n && src[n - 1] != '\n')
+        string_append(s, "\n", 1);
+}
+
+void string_append_int(struct string *s, long v) {
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    unsigned long u = v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        *--p = '-';
+    string_append(s, p, buf + sizeof(buf) - p);
+}
+
+char *read_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+    struct string s;
+    init_string(&s);
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        string_append(&s, buf, n);
+    fclose(f);
+    return s.ptr;
+}
+
+void string_append_json(struct string *s, const char *src, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    // worst case every byte becomes \u00XX; reserving for the common
+    // case and topping up on escapes keeps this a single pass
+    string_reserve(s, n + n / 8);
+    const char *run = src;
+    const char *end = src + n;
+    for (const char *p = src; p < end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        string_append(s, run, p - run);
+        run = p + 1;
+        char esc[6] = {'\\', 0};
+        size_t esc_len = 2;
+        switch (c) {
+            case '"':  esc[1] = '"';  break;
+            case '\\': esc[1] = '\\'; break;
+            case '\n': esc[1] = 'n';  break;
+            case '\r': esc[1] = 'r';  break;
+            case '\t': esc[1] = 't';  break;
+            default:
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 15];
+                esc_len = 6;
+                break;
+        }
+        string_append(s, esc, esc_len);
+    }
+    string_append(s, run, end - run);
+}
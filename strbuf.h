@@ -0,0 +1,32 @@
+#ifndef STRBUF_H
+#define STRBUF_H
+
+#include <stddef.h>
+
+// growable, always NUL terminated string. appends are amortized O(1):
+// the buffer doubles whenever it runs out of room
+struct string {
+    char *ptr;
+    size_t len;
+    size_t cap;
+};
+
+void init_string(struct string *s);
+size_t writefunc(void *ptr, size_t size, size_t nmemb, struct string *s);
+
+// make room for at least extra more bytes (plus the terminator)
+void string_reserve(struct string *s, size_t extra);
+void string_append(struct string *s, const char *src, size_t n);
+void string_append_str(struct string *s, const char *src);
+// appends src, then a '\n' unless it is empty or ends in one already, so
+// the next thing appended starts a line of its own
+void string_append_lines(struct string *s, const char *src);
+void string_append_int(struct string *s, long v);
+// appends src escaped for use inside a JSON string literal
+void string_append_json(struct string *s, const char *src, size_t n);
+
+// the whole file at path in a malloc'd, NUL terminated buffer. NULL if
+// it can't be opened
+char *read_file(const char *path);
+
+#endif
@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "tty_stats.h"
+
+// once stop has been asked for, the relay keeps draining the pty until
+// it has been quiet this long, so the output of endwin is passed on
+#define DRAIN_MS 50
+
+static struct {
+    int master;
+    int slave;
+    // written to by stop to wake the relay
+    int wake[2];
+    pthread_t thread;
+    struct termios saved;
+    int running;
+    unsigned long long bytes_out;
+    unsigned long keypresses;
+} ts = { .master = -1, .slave = -1, .wake = { -1, -1 } };
+
+static int write_all(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0)
+            return -1;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static void *relay(void *arg) {
+    (void)arg;
+    char buf[4096];
+    int stopping = 0;
+    // -1 once stdin is at its end, poll skips it from then on
+    int in = STDIN_FILENO;
+    while (1) {
+        struct pollfd pfd[3] = {
+            { .fd = in, .events = POLLIN },
+            { .fd = ts.master, .events = POLLIN },
+            { .fd = ts.wake[0], .events = POLLIN },
+        };
+        int n = poll(pfd, stopping ? 2 : 3, stopping ? DRAIN_MS : -1);
+        if (n == 0)
+            break;
+        if (n < 0)
+            continue;
+        if (pfd[2].revents & POLLIN)
+            stopping = 1;
+        if (pfd[1].revents & POLLIN) {
+            ssize_t r = read(ts.master, buf, sizeof(buf));
+            if (r <= 0)
+                break;
+            ts.bytes_out += (size_t)r;
+            write_all(STDOUT_FILENO, buf, (size_t)r);
+        } else if (pfd[1].revents & (POLLHUP | POLLERR)) {
+            break;
+        }
+        if (!stopping && (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t r = read(STDIN_FILENO, buf, sizeof(buf));
+            if (r > 0) {
+                ts.keypresses++;
+                write_all(ts.master, buf, (size_t)r);
+            } else if (r == 0 || (pfd[0].revents & (POLLHUP | POLLERR))) {
+                // end of input, which stdin would keep reporting as
+                // readable. nothing more goes to the program, a hangup
+                // still reaches it as SIGHUP from the real terminal
+                in = -1;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void close_fds(void) {
+    int *fds[] = { &ts.master, &ts.slave, &ts.wake[0], &ts.wake[1] };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0)
+            close(*fds[i]);
+        *fds[i] = -1;
+    }
+}
+
+int tty_stats_start(FILE **in, FILE **out) {
+    const char *v = getenv("ATM_TTY_STATS");
+    if (!v || !*v || strcmp(v, "0") == 0)
+        return -1;
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "ATM_TTY_STATS needs a terminal\n");
+        return -1;
+    }
+
+    ts.master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (ts.master < 0 || grantpt(ts.master) != 0 || unlockpt(ts.master) != 0) {
+        perror("pty");
+        close_fds();
+        return -1;
+    }
+    ts.slave = open(ptsname(ts.master), O_RDWR | O_NOCTTY);
+    if (ts.slave < 0 || pipe(ts.wake) != 0) {
+        perror("pty");
+        close_fds();
+        return -1;
+    }
+
+    // the pty looks like the terminal, which passes every byte through
+    // untouched until we're done
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
+        ioctl(ts.slave, TIOCSWINSZ, &ws);
+    tcgetattr(STDIN_FILENO, &ts.saved);
+    tcsetattr(ts.slave, TCSANOW, &ts.saved);
+    struct termios raw = ts.saved;
+    cfmakeraw(&raw);
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    int out_fd = dup(ts.slave);
+    *in = fdopen(ts.slave, "r");
+    *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (!*in || !*out || pthread_create(&ts.thread, NULL, relay, NULL) != 0) {
+        fprintf(stderr, "Failed to set up ATM_TTY_STATS\n");
+        tcsetattr(STDIN_FILENO, TCSANOW, &ts.saved);
+        // a stream closes the fd it was opened on
+        if (*out)
+            fclose(*out);
+        else if (out_fd >= 0)
+            close(out_fd);
+        if (*in) {
+            fclose(*in);
+            ts.slave = -1;
+        }
+        *in = *out = NULL;
+        close_fds();
+        return -1;
+    }
+    ts.running = 1;
+    return 0;
+}
+
+void tty_stats_stop(void) {
+    if (!ts.running)
+        return;
+    ts.running = 0;
+    if (write(ts.wake[1], "", 1) < 0)
+        perror("tty stats");
+    pthread_join(ts.thread, NULL);
+    tcsetattr(STDIN_FILENO, TCSANOW, &ts.saved);
+    close_fds();
+    fprintf(stderr, "tty: %llu bytes out for %lu keypresses, %.0f per keypress\n",
+            ts.bytes_out, ts.keypresses,
+            ts.keypresses ? (double)ts.bytes_out / ts.keypresses : 0.0);
+}
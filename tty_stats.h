@@ -0,0 +1,19 @@
+#ifndef TTY_STATS_H
+#define TTY_STATS_H
+
+#include <stdio.h>
+
+// ATM_TTY_STATS=1 measures what the screen costs over the wire: curses
+// is handed a pty instead of the terminal, and a thread relays between
+// the two, counting the bytes that go out and the reads that come in
+// (one per keypress, give or take a paste). the totals go to stderr
+// when the screen is closed. the pty keeps the size the terminal had at
+// start
+
+// returns 0 with the pty's ends in *in and *out for newterm, -1 if
+// ATM_TTY_STATS is off or the pty couldn't be set up
+int tty_stats_start(FILE **in, FILE **out);
+// after endwin
+void tty_stats_stop(void);
+
+#endif
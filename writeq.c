@@ -0,0 +1,875 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "gist.h"
+#include "journal.h"
+#include "metrics.h"
+#include "writeq.h"
+
+#define FLUSH_MS_DEFAULT 2000
+#define FLUSH_MAX_DEFAULT 64
+#define STOP_ATTEMPTS 3
+// conditional writes lost to other writers before a flush gives up
+#define CAS_ATTEMPTS 5
+// journal segment size that triggers a compaction, ATM_JOURNAL_MAX
+#define JOURNAL_MAX_DEFAULT (4 << 20)
+
+// pending changes, one per regno, with an open addressing index on top
+struct change_set {
+    struct pending_change *items;
+    size_t count;
+    size_t cap;
+    uint32_t *index;
+    size_t index_cap;
+};
+
+// the flush thread's view of one shard's gist
+struct shard {
+    struct gist_conn conn;
+    // the rows of conn's snapshot. while valid they are written back
+    // with If-Match against its ETag, no GET needed first
+    struct account_table table;
+    int table_valid;
+    // this shard's part of the batch being flushed
+    struct change_set batch;
+    // a batch whose PATCH may or may not have gone through, and the rows
+    // it would have produced. settled by the next read of the gist
+    struct change_set doubt;
+    struct account *doubt_rows;
+    size_t doubt_rows_cap;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stop;
+    int flush_now;
+
+    struct change_set pending;
+    struct timespec first_pending;
+    // every change queued since the store last settled, written or not,
+    // for writeq_apply_unsaved
+    struct change_set unsaved;
+    // a refresh got through, a flush that is backing off goes now
+    int resume;
+
+    // every queued change bumps queued; a successful flush moves flushed
+    // up to the queued value it started from
+    unsigned long queued;
+    unsigned long flushed;
+    unsigned long attempts;
+    int last_rc;
+    struct writeq_stats stats;
+
+    long flush_ms;
+    size_t flush_max;
+    // write the gists as compact snapshots instead of csv
+    int compact;
+
+    // write-ahead log of every queued change, when ATM_JOURNAL is set
+    struct journal journal;
+    int journaling;
+    size_t journal_max;
+
+    // only touched by the flush thread
+    struct shard *shards;
+    size_t nshards;
+    struct string csv;
+} q = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void set_reindex(struct change_set *s) {
+    size_t cap = s->index_cap ? s->index_cap : 16;
+    while (cap < s->cap * 2)
+        cap *= 2;
+    free(s->index);
+    s->index = calloc(cap, sizeof(*s->index));
+    if (!s->index) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    s->index_cap = cap;
+    for (size_t i = 0; i < s->count; i++) {
+        size_t b = account_hash(s->items[i].regno) & (cap - 1);
+        while (s->index[b])
+            b = (b + 1) & (cap - 1);
+        s->index[b] = (uint32_t)(i + 1);
+    }
+}
+
+// the entry for regno, created empty if it isn't there yet
+static struct pending_change *set_get(struct change_set *s, const char *regno) {
+    if (s->index_cap) {
+        size_t b = account_hash(regno) & (s->index_cap - 1);
+        while (s->index[b]) {
+            struct pending_change *c = &s->items[s->index[b] - 1];
+            if (strcmp(c->regno, regno) == 0)
+                return c;
+            b = (b + 1) & (s->index_cap - 1);
+        }
+    }
+
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 16;
+        struct pending_change *items = realloc(s->items, cap * sizeof(*items));
+        if (!items) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        s->items = items;
+        s->cap = cap;
+        set_reindex(s);
+    }
+
+    struct pending_change *c = &s->items[s->count++];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->regno, sizeof(c->regno), "%s", regno);
+    size_t b = account_hash(c->regno) & (s->index_cap - 1);
+    while (s->index[b])
+        b = (b + 1) & (s->index_cap - 1);
+    s->index[b] = (uint32_t)s->count;
+    return c;
+}
+
+static void set_clear(struct change_set *s) {
+    s->count = 0;
+    if (s->index)
+        memset(s->index, 0, s->index_cap * sizeof(*s->index));
+}
+
+static void set_free(struct change_set *s) {
+    free(s->items);
+    free(s->index);
+    memset(s, 0, sizeof(*s));
+}
+
+// folds an older change under whatever is pending for the same regno
+static void merge_older(struct change_set *s, const struct pending_change *old) {
+    struct pending_change *c = set_get(s, old->regno);
+    c->balance_delta += old->balance_delta;
+    c->withdrawn += old->withdrawn;
+    if (old->set_pin && !c->set_pin) {
+        c->set_pin = 1;
+        c->pin = old->pin;
+    }
+    if (old->set_name && !c->set_name) {
+        c->set_name = 1;
+        memcpy(c->name, old->name, sizeof(c->name));
+    }
+}
+
+void apply_changes(struct account_table *t, const struct pending_change *changes, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        const struct pending_change *c = &changes[i];
+        struct account *a = account_table_find(t, c->regno);
+        if (!a)
+            continue;
+        a->balance += c->balance_delta;
+        if (c->set_pin)
+            a->pin = c->pin;
+        if (c->set_name)
+            memcpy(a->name, c->name, sizeof(a->name));
+    }
+}
+
+// reports the rows the write of batch just left below zero because of
+// its withdrawals: another writer spent the money they were checked
+// against. the cash is out already, so the debit stays
+static void note_overdrafts(const struct shard *sh, const struct change_set *batch,
+                            unsigned long upto) {
+    for (size_t i = 0; i < batch->count; i++) {
+        const struct pending_change *c = &batch->items[i];
+        const struct account *a = c->withdrawn ? account_table_find(&sh->table, c->regno) : NULL;
+        if (!a || a->balance >= 0)
+            continue;
+        fprintf(stderr, "Withdrawal of %d overdrew %s to %d, another terminal spent the money first\n",
+                c->withdrawn, c->regno, a->balance);
+        pthread_mutex_lock(&q.lock);
+        q.stats.overdrawn++;
+        pthread_mutex_unlock(&q.lock);
+        if (q.journaling) {
+            struct journal_record r = { .type = 'X', .seq = upto, .delta = c->withdrawn,
+                                        .balance = a->balance };
+            memcpy(r.regno, c->regno, sizeof(r.regno));
+            journal_append(&q.journal, &r);
+        }
+    }
+}
+
+// records the rows the write of batch is going to leave behind, for
+// settling it later should its fate be unknown
+static void capture_rows(struct shard *sh, const struct change_set *batch) {
+    if (sh->doubt_rows_cap < batch->count) {
+        free(sh->doubt_rows);
+        sh->doubt_rows = malloc(batch->cap * sizeof(*sh->doubt_rows));
+        if (!sh->doubt_rows) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        sh->doubt_rows_cap = batch->cap;
+    }
+    for (size_t i = 0; i < batch->count; i++) {
+        const struct account *a = account_table_find(&sh->table, batch->items[i].regno);
+        if (a)
+            sh->doubt_rows[i] = *a;
+        else
+            sh->doubt_rows[i].regno[0] = '\0';
+    }
+}
+
+// keeps a batch we don't know the fate of. its rows were captured
+// before the write went out
+static void remember_doubt(struct shard *sh, struct change_set *batch) {
+    struct change_set t = sh->doubt;
+    sh->doubt = *batch;
+    *batch = t;
+    set_clear(batch);
+}
+
+// whether the freshly loaded rows look the way the in-doubt write would
+// have left them. only the fields the write changed are compared, other
+// writers may have touched the rest since. someone else producing
+// exactly the same values is possible but far less likely than the
+// write having gone through
+static int doubt_landed(const struct shard *sh) {
+    for (size_t i = 0; i < sh->doubt.count; i++) {
+        const struct pending_change *c = &sh->doubt.items[i];
+        const struct account *want = &sh->doubt_rows[i];
+        if (!want->regno[0])
+            continue;
+        const struct account *a = account_table_find(&sh->table, want->regno);
+        if (!a || (c->balance_delta && a->balance != want->balance) ||
+            (c->set_pin && a->pin != want->pin) ||
+            (c->set_name && strcmp(a->name, want->name) != 0))
+            return 0;
+    }
+    return 1;
+}
+
+// logs that a write of everything up to upto is going out, and the rows
+// it leaves behind. after a crash these settle whether it went through.
+// each shard's write logs its own F with the same seq, followed by the
+// rows of that shard
+static void journal_intent(const struct shard *sh, const struct change_set *batch,
+                           unsigned long upto) {
+    struct journal_record r = { .type = 'F', .seq = upto };
+    journal_append(&q.journal, &r);
+    for (size_t i = 0; i < batch->count; i++) {
+        const struct account *a = &sh->doubt_rows[i];
+        if (!a->regno[0])
+            continue;
+        r = (struct journal_record){ .type = 'R', .pin = a->pin, .balance = a->balance };
+        memcpy(r.regno, a->regno, sizeof(r.regno));
+        memcpy(r.name, a->name, sizeof(r.name));
+        journal_append(&q.journal, &r);
+    }
+    journal_sync(&q.journal);
+}
+
+// one conditional PATCH for any number of queued changes to a shard.
+// the gist is only read when our copy of it is stale: at startup, after
+// another writer got in first (412) and after a failed write
+static int flush_shard(struct shard *sh, unsigned long upto) {
+    struct change_set *batch = &sh->batch;
+    for (int attempt = 0; attempt < CAS_ATTEMPTS; attempt++) {
+        if (!sh->table_valid) {
+            const char *content = gist_fetch(&sh->conn);
+            if (!content)
+                return GIST_ERROR;
+            if (account_table_load(&sh->table, content) != 0)
+                return GIST_ERROR;
+            sh->table_valid = 1;
+            if (sh->doubt.count) {
+                if (!doubt_landed(sh)) {
+                    for (size_t i = 0; i < sh->doubt.count; i++)
+                        merge_older(batch, &sh->doubt.items[i]);
+                }
+                set_clear(&sh->doubt);
+            }
+            if (batch->count == 0)
+                return GIST_OK;
+        }
+
+        // deltas, not absolute values, so a retry on top of somebody
+        // else's write keeps their change
+        apply_changes(&sh->table, batch->items, batch->count);
+        capture_rows(sh, batch);
+        if (q.journaling)
+            journal_intent(sh, batch, upto);
+        q.csv.len = 0;
+        if (q.compact)
+            account_table_append_compact(&sh->table, &q.csv);
+        else
+            account_table_append_csv(&sh->table, &q.csv);
+        int rc = gist_update_if_match(&sh->conn, q.csv.ptr);
+        if (rc == GIST_OK) {
+            // the If-Match held, so these are the rows as they now are
+            note_overdrafts(sh, batch, upto);
+            // without an ETag the next write couldn't name this revision
+            sh->table_valid = sh->conn.etag != NULL;
+            return GIST_OK;
+        }
+
+        // the rows now hold changes the gist doesn't
+        sh->table_valid = 0;
+        if (rc == GIST_ERROR)
+            return rc;
+        // a 412 normally means another writer got in first, but libcurl
+        // silently resends a request whose reused connection died, and
+        // the first copy may have been applied. so a conflict is settled
+        // like an in-doubt write: by looking at the rows after the reread
+        remember_doubt(sh, batch);
+        if (rc == GIST_IN_DOUBT)
+            return rc;
+        pthread_mutex_lock(&q.lock);
+        q.stats.conflicts++;
+        pthread_mutex_unlock(&q.lock);
+    }
+    return GIST_CONFLICT;
+}
+
+// splits the batch by shard and writes each part to its own gist. a
+// shard with nothing queued and nothing in doubt isn't touched at all.
+// the changes of shards that failed are left in batch, the rest is done
+// (or in doubt) and must not be queued again
+static int flush_batch(struct change_set *batch, unsigned long upto) {
+    for (size_t i = 0; i < batch->count; i++)
+        merge_older(&q.shards[gist_shard_of(batch->items[i].regno)].batch, &batch->items[i]);
+    set_clear(batch);
+
+    int rc = GIST_OK;
+    for (size_t k = 0; k < q.nshards; k++) {
+        struct shard *sh = &q.shards[k];
+        if (!sh->batch.count && !sh->doubt.count)
+            continue;
+        int r = flush_shard(sh, upto);
+        if (r != GIST_OK) {
+            if (rc == GIST_OK || r == GIST_IN_DOUBT)
+                rc = r;
+            for (size_t i = 0; i < sh->batch.count; i++)
+                merge_older(batch, &sh->batch.items[i]);
+        }
+        set_clear(&sh->batch);
+    }
+    return rc;
+}
+
+// whether every shard's rows are known, for a snapshot of all of them.
+// shards nothing was written to were never read, they are read now
+static int shards_settled(void) {
+    for (size_t k = 0; k < q.nshards; k++) {
+        struct shard *sh = &q.shards[k];
+        if (sh->doubt.count)
+            return 0;
+        if (sh->table_valid)
+            continue;
+        const char *content = gist_fetch(&sh->conn);
+        if (!content || account_table_load(&sh->table, content) != 0)
+            return 0;
+        sh->table_valid = 1;
+    }
+    return 1;
+}
+
+static struct timespec deadline_after(const struct timespec *from, long ms) {
+    struct timespec t = *from;
+    t.tv_sec += ms / 1000;
+    t.tv_nsec += (ms % 1000) * 1000000L;
+    if (t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+    return t;
+}
+
+// every change up to upto is in the gist. the segment is compacted
+// into a snapshot once it is big and nothing is outstanding
+static void checkpoint(unsigned long upto) {
+    struct journal_record r = { .type = 'C', .seq = upto };
+    journal_append(&q.journal, &r);
+    if (journal_size(&q.journal) < q.journal_max || !shards_settled())
+        return;
+    pthread_mutex_lock(&q.lock);
+    int idle = q.queued == upto;
+    pthread_mutex_unlock(&q.lock);
+    if (!idle)
+        return;
+    journal_sync(&q.journal);
+    q.csv.len = 0;
+    for (size_t k = 0; k < q.nshards; k++)
+        account_table_append_csv(&q.shards[k].table, &q.csv);
+    journal_compact(&q.journal, q.csv.ptr, upto);
+}
+
+// the doubt sets are the flush thread's: only called from it, or
+// before it starts and after it has stopped
+static size_t doubt_count(void) {
+    size_t n = 0;
+    for (size_t k = 0; k < q.nshards; k++)
+        n += q.shards[k].doubt.count;
+    return n;
+}
+
+static int has_work(void) {
+    return q.pending.count != 0 || doubt_count() != 0;
+}
+
+static void *flush_main(void *arg) {
+    (void)arg;
+    struct change_set batch = {0};
+    struct timespec retry_at = {0};
+    // failed flushes in a row, the backoff grows with them
+    int failures = 0;
+
+    pthread_mutex_lock(&q.lock);
+    while (1) {
+        // sleep until something is due: the oldest change has waited
+        // long enough or enough regnos are pending, but never before the
+        // retry backoff of a failed flush is over. an in-doubt batch is
+        // due as soon as the backoff allows
+        while (!q.flush_now && !(q.stop && !has_work())) {
+            if (q.resume) {
+                retry_at = (struct timespec){0};
+                q.resume = 0;
+            }
+            if (!has_work()) {
+                pthread_cond_wait(&q.cond, &q.lock);
+                continue;
+            }
+            struct timespec due = {0};
+            if (!q.stop && q.pending.count && q.pending.count < q.flush_max)
+                due = deadline_after(&q.first_pending, q.flush_ms);
+            // backoff, which may run as long as a rate limit, is no
+            // reason to hold up shutdown
+            if (!q.stop && (due.tv_sec < retry_at.tv_sec ||
+                            (due.tv_sec == retry_at.tv_sec && due.tv_nsec < retry_at.tv_nsec)))
+                due = retry_at;
+            if (pthread_cond_timedwait(&q.cond, &q.lock, &due) == ETIMEDOUT)
+                break;
+        }
+        if (q.stop && !has_work())
+            break;
+        if (!has_work()) {
+            // explicit flush with nothing to do
+            q.flush_now = 0;
+            q.last_rc = 0;
+            q.attempts++;
+            pthread_cond_broadcast(&q.cond);
+            continue;
+        }
+
+        struct change_set t = q.pending;
+        q.pending = batch;
+        batch = t;
+        set_clear(&q.pending);
+        unsigned long upto = q.queued;
+        q.flush_now = 0;
+        pthread_mutex_unlock(&q.lock);
+
+        uint64_t t0 = metrics_now_us();
+        int rc = flush_batch(&batch, upto);
+        metrics_observe(METRIC_FLUSH, metrics_now_us() - t0);
+        if (rc == GIST_OK && q.journaling)
+            checkpoint(upto);
+
+        pthread_mutex_lock(&q.lock);
+        if (rc == GIST_OK) {
+            q.flushed = upto;
+            q.stats.flushes++;
+            retry_at = (struct timespec){0};
+            failures = 0;
+        } else {
+            if (rc == GIST_IN_DOUBT)
+                q.stats.in_doubt++;
+            else
+                q.stats.failures++;
+            // keep the changes, newer ones queued meanwhile take precedence.
+            // an in-doubt batch was moved aside and is settled by the next
+            // flush once it can see what the gist holds, and shards that
+            // were written are out of the batch already
+            for (size_t i = 0; i < batch.count; i++)
+                merge_older(&q.pending, &batch.items[i]);
+            clock_gettime(CLOCK_REALTIME, &retry_at);
+            retry_at = deadline_after(&retry_at, gist_retry_delay_ms(failures++));
+            // only a refresh that got through after this failure cuts
+            // its backoff short
+            q.resume = 0;
+        }
+        set_clear(&batch);
+        q.last_rc = rc;
+        q.attempts++;
+        pthread_cond_broadcast(&q.cond);
+        if (rc != 0 && q.stop)
+            break;
+    }
+    pthread_mutex_unlock(&q.lock);
+    set_free(&batch);
+    return NULL;
+}
+
+// what a journal replay found past the last checkpoint
+struct recovery {
+    unsigned long last_seq;
+    unsigned long checkpoint;
+    // the last write that was sent but never confirmed, 0 if none
+    unsigned long intent;
+    struct journal_record *recs;
+    size_t count;
+    size_t cap;
+    // the rows that write would have left behind
+    struct account *rows;
+    size_t nrows;
+    size_t rows_cap;
+};
+
+static void *grow(void *p, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap)
+        return p;
+    size_t n = *cap ? *cap * 2 : 16;
+    while (n < need)
+        n *= 2;
+    p = realloc(p, n * size);
+    if (!p) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    *cap = n;
+    return p;
+}
+
+static void recover_record(const struct journal_record *r, void *arg) {
+    struct recovery *rc = arg;
+    if (r->type == 'R') {
+        if (!rc->intent)
+            return;
+        rc->rows = grow(rc->rows, &rc->rows_cap, rc->nrows + 1, sizeof(*rc->rows));
+        struct account *a = &rc->rows[rc->nrows++];
+        memcpy(a->regno, r->regno, sizeof(a->regno));
+        memcpy(a->name, r->name, sizeof(a->name));
+        a->pin = r->pin;
+        a->balance = r->balance;
+        return;
+    }
+    if (r->seq > rc->last_seq)
+        rc->last_seq = r->seq;
+
+    if (r->type == 'C') {
+        if (r->seq < rc->checkpoint)
+            return;
+        rc->checkpoint = r->seq;
+        if (rc->intent <= r->seq) {
+            rc->intent = 0;
+            rc->nrows = 0;
+        }
+        // keep what was queued while that write was on its way
+        size_t n = 0;
+        for (size_t i = 0; i < rc->count; i++) {
+            if (rc->recs[i].seq > r->seq)
+                rc->recs[n++] = rc->recs[i];
+        }
+        rc->count = n;
+    } else if (r->type == 'F') {
+        // the shards of one write each log an F with the same seq
+        if (r->seq != rc->intent)
+            rc->nrows = 0;
+        rc->intent = r->seq;
+    } else if (r->type == 'X') {
+        // for the audit trail, the withdrawal is in its B record
+        return;
+    } else if (r->seq > rc->checkpoint) {
+        rc->recs = grow(rc->recs, &rc->cap, rc->count + 1, sizeof(*rc->recs));
+        rc->recs[rc->count++] = *r;
+    }
+}
+
+static void set_add_record(struct change_set *s, const struct journal_record *r) {
+    struct pending_change *c = set_get(s, r->regno);
+    if (r->type == 'B') {
+        c->balance_delta += r->delta;
+        if (r->delta < 0)
+            c->withdrawn -= r->delta;
+    } else if (r->type == 'P') {
+        c->set_pin = 1;
+        c->pin = r->pin;
+    } else if (r->type == 'N') {
+        c->set_name = 1;
+        memcpy(c->name, r->name, sizeof(c->name));
+    }
+}
+
+// the last row logged for regno, NULL if there is none
+static const struct account *logged_row(const struct recovery *rc, const char *regno) {
+    const struct account *row = NULL;
+    for (size_t k = 0; k < rc->nrows; k++) {
+        if (strcmp(rc->rows[k].regno, regno) == 0)
+            row = &rc->rows[k];
+    }
+    return row;
+}
+
+// opens the journal and requeues every change the gist may not have.
+// changes covered by an unconfirmed write become the in-doubt batch of
+// their shard, settled against the rows it logged once the gist has
+// been read. a change without a logged row belongs to a shard whose
+// write never went out, it is simply pending
+static int recover(const char *path) {
+    struct recovery rc = {0};
+    if (journal_open(&q.journal, path, recover_record, &rc) != 0)
+        return -1;
+    q.journaling = 1;
+
+    for (size_t i = 0; i < rc.count; i++) {
+        const struct journal_record *r = &rc.recs[i];
+        int in_doubt = rc.intent && r->seq <= rc.intent && logged_row(&rc, r->regno);
+        set_add_record(in_doubt ? &q.shards[gist_shard_of(r->regno)].doubt : &q.pending, r);
+        set_add_record(&q.unsaved, r);
+    }
+    for (size_t k = 0; k < q.nshards; k++) {
+        struct shard *sh = &q.shards[k];
+        sh->doubt_rows = grow(sh->doubt_rows, &sh->doubt_rows_cap, sh->doubt.count,
+                              sizeof(*sh->doubt_rows));
+        for (size_t i = 0; i < sh->doubt.count; i++)
+            sh->doubt_rows[i] = *logged_row(&rc, sh->doubt.items[i].regno);
+    }
+
+    size_t doubt = doubt_count();
+    q.queued = rc.last_seq;
+    q.flushed = q.pending.count || doubt ? rc.checkpoint : rc.last_seq;
+    if (q.pending.count)
+        clock_gettime(CLOCK_REALTIME, &q.first_pending);
+    if (q.pending.count || doubt)
+        fprintf(stderr, "Recovered unsaved changes for %zu account(s) from %s\n",
+                q.pending.count + doubt, path);
+    free(rc.recs);
+    free(rc.rows);
+    return 0;
+}
+
+static long env_long(const char *name, long def) {
+    const char *v = getenv(name);
+    long n = v ? atol(v) : 0;
+    return n > 0 ? n : def;
+}
+
+int writeq_start(void) {
+    q.flush_ms = env_long("ATM_FLUSH_MS", FLUSH_MS_DEFAULT);
+    q.flush_max = (size_t)env_long("ATM_FLUSH_MAX", FLUSH_MAX_DEFAULT);
+    q.journal_max = (size_t)env_long("ATM_JOURNAL_MAX", JOURNAL_MAX_DEFAULT);
+    const char *format = getenv("ATM_SNAPSHOT_FORMAT");
+    if (format && *format && strcmp(format, "csv") != 0 && strcmp(format, "compact") != 0) {
+        fprintf(stderr, "Unknown ATM_SNAPSHOT_FORMAT: %s\n", format);
+        return -1;
+    }
+    q.compact = format && strcmp(format, "compact") == 0;
+    q.nshards = gist_shard_count();
+    q.shards = calloc(q.nshards, sizeof(*q.shards));
+    if (!q.shards) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (size_t k = 0; k < q.nshards; k++) {
+        if (gist_conn_init(&q.shards[k].conn) != 0)
+            return -1;
+        gist_conn_set_shard(&q.shards[k].conn, k);
+    }
+    init_string(&q.csv);
+    const char *journal = getenv("ATM_JOURNAL");
+    if (journal && *journal && recover(journal) != 0)
+        return -1;
+
+    if (pthread_create(&q.thread, NULL, flush_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start flush thread\n");
+        return -1;
+    }
+    q.running = 1;
+    return 0;
+}
+
+size_t writeq_stop(void) {
+    if (!q.running)
+        return 0;
+    for (int i = 0; i < STOP_ATTEMPTS && writeq_flush() != 0; i++)
+        ;
+
+    pthread_mutex_lock(&q.lock);
+    q.stop = 1;
+    pthread_cond_broadcast(&q.cond);
+    pthread_mutex_unlock(&q.lock);
+    pthread_join(q.thread, NULL);
+    q.running = 0;
+
+    size_t lost = q.pending.count + doubt_count();
+    set_free(&q.pending);
+    set_free(&q.unsaved);
+    for (size_t k = 0; k < q.nshards; k++) {
+        struct shard *sh = &q.shards[k];
+        set_free(&sh->batch);
+        set_free(&sh->doubt);
+        free(sh->doubt_rows);
+        gist_conn_cleanup(&sh->conn);
+        account_table_free(&sh->table);
+    }
+    free(q.shards);
+    q.shards = NULL;
+    q.nshards = 0;
+    if (q.journaling) {
+        // nothing in the journal is lost, the next start sends it
+        if (lost)
+            fprintf(stderr, "Changes for %zu account(s) are kept in %s until the gist can be reached\n",
+                    lost, q.journal.path);
+        lost = 0;
+        journal_close(&q.journal);
+        q.journaling = 0;
+    }
+    free(q.csv.ptr);
+    q.csv.ptr = NULL;
+    return lost;
+}
+
+// called with the lock held after changing pending. r is the journal
+// record for the change, it gets the change's sequence number
+static void queued_locked(int was_empty, struct journal_record *r) {
+    if (was_empty)
+        clock_gettime(CLOCK_REALTIME, &q.first_pending);
+    q.queued++;
+    if (q.journaling) {
+        r->seq = q.queued;
+        journal_append(&q.journal, r);
+    }
+    pthread_cond_signal(&q.cond);
+}
+
+void writeq_add_balance(const char *regno, int delta, int balance) {
+    struct journal_record r = { .type = 'B', .delta = delta, .balance = balance };
+    snprintf(r.regno, sizeof(r.regno), "%s", regno);
+    pthread_mutex_lock(&q.lock);
+    int was_empty = q.pending.count == 0;
+    struct pending_change *c = set_get(&q.pending, regno);
+    c->balance_delta += delta;
+    if (delta < 0)
+        c->withdrawn -= delta;
+    set_get(&q.unsaved, regno)->balance_delta += delta;
+    queued_locked(was_empty, &r);
+    pthread_mutex_unlock(&q.lock);
+}
+
+void writeq_set_name(const char *regno, const char *name) {
+    struct journal_record r = { .type = 'N' };
+    snprintf(r.regno, sizeof(r.regno), "%s", regno);
+    snprintf(r.name, sizeof(r.name), "%s", name);
+    pthread_mutex_lock(&q.lock);
+    int was_empty = q.pending.count == 0;
+    struct pending_change *c = set_get(&q.pending, regno);
+    c->set_name = 1;
+    memcpy(c->name, r.name, sizeof(c->name));
+    c = set_get(&q.unsaved, regno);
+    c->set_name = 1;
+    memcpy(c->name, r.name, sizeof(c->name));
+    queued_locked(was_empty, &r);
+    pthread_mutex_unlock(&q.lock);
+}
+
+void writeq_set_pin(const char *regno, int pin) {
+    struct journal_record r = { .type = 'P', .pin = pin };
+    snprintf(r.regno, sizeof(r.regno), "%s", regno);
+    pthread_mutex_lock(&q.lock);
+    int was_empty = q.pending.count == 0;
+    struct pending_change *c = set_get(&q.pending, regno);
+    c->set_pin = 1;
+    c->pin = pin;
+    c = set_get(&q.unsaved, regno);
+    c->set_pin = 1;
+    c->pin = pin;
+    queued_locked(was_empty, &r);
+    pthread_mutex_unlock(&q.lock);
+}
+
+int writeq_commit(void) {
+    return q.journaling ? journal_sync(&q.journal) : 0;
+}
+
+struct writeq_ticket writeq_flush_start(void) {
+    pthread_mutex_lock(&q.lock);
+    struct writeq_ticket t = { .target = q.queued, .attempts = q.attempts };
+    if (q.flushed < t.target) {
+        q.flush_now = 1;
+        pthread_cond_broadcast(&q.cond);
+    }
+    pthread_mutex_unlock(&q.lock);
+    return t;
+}
+
+int writeq_flush_wait(struct writeq_ticket *t, int timeout_ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until = deadline_after(&until, timeout_ms);
+
+    int rc = 0;
+    pthread_mutex_lock(&q.lock);
+    while (q.running && q.flushed < t->target) {
+        if (q.attempts != t->attempts) {
+            if (q.last_rc != 0) {
+                rc = -1;
+                break;
+            }
+            // that flush started before ours was asked for, go again
+            t->attempts = q.attempts;
+            q.flush_now = 1;
+            pthread_cond_broadcast(&q.cond);
+        }
+        if (pthread_cond_timedwait(&q.cond, &q.lock, &until) == ETIMEDOUT)
+            break;
+    }
+    if (rc == 0 && (!q.running || q.flushed >= t->target))
+        rc = 1;
+    pthread_mutex_unlock(&q.lock);
+    return rc;
+}
+
+int writeq_flush(void) {
+    struct writeq_ticket t = writeq_flush_start();
+    int rc;
+    while ((rc = writeq_flush_wait(&t, 1000)) == 0)
+        ;
+    return rc == 1 ? 0 : -1;
+}
+
+void writeq_get_stats(struct writeq_stats *out) {
+    pthread_mutex_lock(&q.lock);
+    *out = q.stats;
+    out->queued = q.queued;
+    out->flushed = q.flushed;
+    pthread_mutex_unlock(&q.lock);
+}
+
+void writeq_apply_unsaved(struct account_table *t) {
+    pthread_mutex_lock(&q.lock);
+    apply_changes(t, q.unsaved.items, q.unsaved.count);
+    pthread_mutex_unlock(&q.lock);
+}
+
+int writeq_settle(unsigned long queued) {
+    pthread_mutex_lock(&q.lock);
+    int settled = q.queued == queued && q.flushed == queued;
+    if (settled)
+        set_clear(&q.unsaved);
+    pthread_mutex_unlock(&q.lock);
+    return settled;
+}
+
+void writeq_resume(void) {
+    // the doubt sets belong to the flush thread, so whether there is
+    // anything to resume is left to it
+    pthread_mutex_lock(&q.lock);
+    q.resume = 1;
+    pthread_cond_broadcast(&q.cond);
+    pthread_mutex_unlock(&q.lock);
+}
@@ -0,0 +1,117 @@
+#ifndef WRITEQ_H
+#define WRITEQ_H
+
+#include "accounts.h"
+
+// write-behind queue for account changes. changes are merged per regno
+// (balance deltas add up, the newest name/pin wins) and a background
+// thread writes them out as one PATCH once the oldest has waited
+// ATM_FLUSH_MS milliseconds (default 2000) or ATM_FLUSH_MAX regnos
+// (default 64) are pending.
+//
+// writes are compare-and-swap: the PATCH carries If-Match with the ETag
+// the rows were read at. when another writer got in first the gist is
+// read again, the queued deltas are applied on top and the write is
+// retried. a withdrawal that leaves its row below zero that way is
+// still written, the money was paid out, and reported as an overdraft.
+// with the accounts sharded (gist.h) a flush splits its changes by
+// shard and only PATCHes the gists they belong to.
+//
+// ATM_SNAPSHOT_FORMAT=compact writes the gists as compact snapshots
+// (snapshot.h) rather than csv, several times smaller. either format is
+// read whatever the setting, so a gist is converted by its next write.
+//
+// with ATM_JOURNAL=path every change is also appended to a journal
+// (journal.h) before it is acknowledged. whatever the gist may be
+// missing after a crash is requeued from it on the next start, and the
+// journal is compacted into path.snap once it outgrows ATM_JOURNAL_MAX
+// bytes (default 4 MiB).
+//
+// while the gist can't be reached the changes simply pile up, merged
+// per regno, and the flush keeps retrying with backoff. the first one
+// to get through writes the whole backlog as one PATCH per shard, still
+// compare-and-swap. with a journal they also outlive the process
+
+struct pending_change {
+    char regno[REGNO_LEN];
+    int balance_delta;
+    // the withdrawals in balance_delta, as a positive sum, to tell an
+    // overdraft this change makes from one the row had already
+    int withdrawn;
+    int set_pin;
+    int pin;
+    int set_name;
+    char name[NAME_LEN];
+};
+
+struct writeq_stats {
+    // sequence numbers: every queued change bumps queued, flushed
+    // catches up as they are written. equal when nothing is unsaved
+    unsigned long queued;
+    unsigned long flushed;
+    // PATCHes that went through
+    unsigned long flushes;
+    // PATCHes refused because the gist had moved on, each followed by a
+    // reread and a retry
+    unsigned long conflicts;
+    // flushes given up on, their changes were requeued
+    unsigned long failures;
+    // flushes where the connection failed without telling us whether
+    // the write went through
+    unsigned long in_doubt;
+    // regnos whose withdrawals were written below zero because another
+    // writer had spent the money first. each is reported on stderr and,
+    // with a journal, logged there as an X record
+    unsigned long overdrawn;
+};
+
+int writeq_start(void);
+// final flush and shutdown. returns the number of changes that could
+// not be written; with a journal that is 0, whatever is left goes out
+// on the next start
+size_t writeq_stop(void);
+
+// balance is the row's balance after delta as the caller sees it, it
+// only goes into the journal
+void writeq_add_balance(const char *regno, int delta, int balance);
+void writeq_set_name(const char *regno, const char *name);
+void writeq_set_pin(const char *regno, int pin);
+// makes every change queued so far durable in the journal, a no-op
+// without one. concurrent callers share a single fsync. returns 0 on
+// success
+int writeq_commit(void);
+
+// blocks until everything queued before the call has been written.
+// returns 0 on success, -1 if a flush attempt failed (the changes stay
+// queued and are retried in the background)
+int writeq_flush(void);
+
+// the same in steps, so the caller can keep its ui alive meanwhile
+struct writeq_ticket {
+    unsigned long target;
+    unsigned long attempts;
+};
+struct writeq_ticket writeq_flush_start(void);
+// waits at most timeout_ms. returns 1 once the ticket's changes are
+// written, -1 if the attempt failed, 0 if it is still running
+int writeq_flush_wait(struct writeq_ticket *t, int timeout_ms);
+
+void writeq_get_stats(struct writeq_stats *out);
+
+// what a reader of the gist needs to show this process's own changes
+// before they are written, or while it can't write them at all: every
+// change queued since the last successful settle, merged per regno, is
+// applied to t. settle forgets them once nothing was queued since the
+// caller saw queued and all of it is written, so rows read after that
+// have it; returns 1 if so, then the rows need nothing applied
+void writeq_apply_unsaved(struct account_table *t);
+int writeq_settle(unsigned long queued);
+// the gist answered again: a flush that failed and is waiting out its
+// backoff is tried now
+void writeq_resume(void);
+
+// applies changes[0..n) to the rows of t. rows that no longer exist are
+// skipped
+void apply_changes(struct account_table *t, const struct pending_change *changes, size_t n);
+
+#endif